@@ -0,0 +1,356 @@
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "blend.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLEND_X86
+#include <immintrin.h>
+#endif
+
+static void blend_span_scalar(argb *dst, argb src, int n) {
+    for (int i = 0; i < n; i++)
+        dst[i] = blend_pixel(dst[i], src);
+}
+
+static void set_span_scalar(argb *dst, argb c, int n) {
+    for (int i = 0; i < n; i++)
+        dst[i] = c;
+}
+
+static void over_span_scalar(argb *out, const argb *dst, const argb *src,
+                             int n, bool swap) {
+    for (int i = 0; i < n; i++) {
+        argb c = src[i] >> 24 ? blend_pixel(dst[i], src[i]) : dst[i];
+        out[i] = swap ? argb_swap_rb(c) : c;
+    }
+}
+
+static void mask_span_scalar(argb *dst, argb color, const uint8_t *mask,
+                             int n, bool blend) {
+    const uint32_t a = color >> 24;
+    for (int i = 0; i < n; i++) {
+        if (mask[i] == 0)
+            continue;
+        argb c = (color & 0x00FFFFFF) | (argb)DIV255(mask[i] * a) << 24;
+        dst[i] = blend ? blend_pixel(dst[i], c) : c;
+    }
+}
+
+static int match_span_scalar(const argb *px, int n, argb ref, int tolerance,
+                             bool want) {
+    int i = 0;
+    while (i < n && color_match(px[i], ref, tolerance) == want)
+        i++;
+    return i;
+}
+
+#ifdef BLEND_X86
+
+/* gcc does not add vzeroupper on its own when avx2 comes from a target
+ * attribute instead of -mavx2, so the avx2 variants clear the upper
+ * halves themselves before returning. without that every later sse
+ * instruction in the caller pays for the dirty upper state */
+
+/* src is constant over the span, so src_c * a + 128 is precomputed per
+ * channel and each pixel costs one 16 bit multiply-add per channel */
+
+__attribute__((target("sse2")))
+static void blend_span_sse2(argb *dst, argb src, int n) {
+    uint32_t a = src >> 24;
+    if (a == 0)
+        return;
+    int i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ia = _mm_set1_epi16((short)(255 - a));
+    /* b, g, r, a order of the bytes in memory */
+    const __m128i s = _mm_set_epi16(
+        (short)(255 * a + 128), (short)(((src >> 16) & 0xFF) * a + 128),
+        (short)(((src >> 8) & 0xFF) * a + 128), (short)((src & 0xFF) * a + 128),
+        (short)(255 * a + 128), (short)(((src >> 16) & 0xFF) * a + 128),
+        (short)(((src >> 8) & 0xFF) * a + 128), (short)((src & 0xFF) * a + 128));
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia), s);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia), s);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_span_scalar(dst + i, src, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(argb *dst, argb src, int n) {
+    uint32_t a = src >> 24;
+    if (a == 0)
+        return;
+    int i = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ia = _mm256_set1_epi16((short)(255 - a));
+    const uint64_t lane = (uint64_t)(255 * a + 128) << 48 |
+                          (uint64_t)(((src >> 16) & 0xFF) * a + 128) << 32 |
+                          (uint64_t)(((src >> 8) & 0xFF) * a + 128) << 16 |
+                          (uint64_t)((src & 0xFF) * a + 128);
+    const __m256i s = _mm256_set1_epi64x((long long)lane);
+    /* unpack works within 128 bit lanes, pack undoes it the same way,
+     * so pixel order is kept without any permute */
+    for (; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_loadu_si256((__m256i *)(dst + i));
+        __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia), s);
+        __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia), s);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    blend_span_scalar(dst + i, src, n - i);
+}
+
+__attribute__((target("sse2")))
+static void set_span_sse2(argb *dst, argb c, int n) {
+    int i = 0;
+    const __m128i v = _mm_set1_epi32((int)c);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    set_span_scalar(dst + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void set_span_avx2(argb *dst, argb c, int n) {
+    int i = 0;
+    const __m256i v = _mm256_set1_epi32((int)c);
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    _mm256_zeroupper();
+    set_span_scalar(dst + i, c, n - i);
+}
+
+/* like blend_span with a different src per pixel, its alpha is spread
+ * over the four words of the pixel. blocks whose src is all transparent
+ * are copied, the common case for a preview layer */
+
+__attribute__((target("sse2")))
+static inline __m128i swap_rb_sse2(__m128i v) {
+    const __m128i ag = _mm_set1_epi32((int)0xFF00FF00);
+    const __m128i b = _mm_set1_epi32(0xFF);
+    return _mm_or_si128(_mm_and_si128(v, ag),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), b),
+                                     _mm_slli_epi32(_mm_and_si128(v, b), 16)));
+}
+
+__attribute__((target("sse2")))
+static void over_span_sse2(argb *out, const argb *dst, const argb *src,
+                           int n, bool swap) {
+    int i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32((int)0xFF000000);
+    const __m128i ff = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, amask), zero)) != 0xFFFF) {
+            __m128i slo = _mm_unpacklo_epi8(s, zero);
+            __m128i shi = _mm_unpackhi_epi8(s, zero);
+            __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+            __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+            /* src alpha counts as 255 */
+            slo = _mm_or_si128(slo, _mm_unpacklo_epi8(amask, zero));
+            shi = _mm_or_si128(shi, _mm_unpackhi_epi8(amask, zero));
+            __m128i lo = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(slo, alo),
+                              _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(ff, alo))),
+                half);
+            __m128i hi = _mm_add_epi16(
+                _mm_add_epi16(_mm_mullo_epi16(shi, ahi),
+                              _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(ff, ahi))),
+                half);
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+            d = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i *)(out + i), swap ? swap_rb_sse2(d) : d);
+    }
+    over_span_scalar(out + i, dst + i, src + i, n - i, swap);
+}
+
+__attribute__((target("avx2")))
+static void over_span_avx2(argb *out, const argb *dst, const argb *src,
+                           int n, bool swap) {
+    int i = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i amask = _mm256_set1_epi32((int)0xFF000000);
+    const __m256i ff = _mm256_set1_epi16(255);
+    const __m256i half = _mm256_set1_epi16(128);
+    /* per 16 bit word, the alpha word of its pixel */
+    const __m256i abcast = _mm256_setr_epi8(
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+        6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+    const __m256i rb = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        if (!_mm256_testz_si256(s, amask)) {
+            __m256i slo = _mm256_unpacklo_epi8(s, zero);
+            __m256i shi = _mm256_unpackhi_epi8(s, zero);
+            __m256i alo = _mm256_shuffle_epi8(slo, abcast);
+            __m256i ahi = _mm256_shuffle_epi8(shi, abcast);
+            slo = _mm256_or_si256(slo, _mm256_unpacklo_epi8(amask, zero));
+            shi = _mm256_or_si256(shi, _mm256_unpackhi_epi8(amask, zero));
+            __m256i lo = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(slo, alo),
+                                 _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(ff, alo))),
+                half);
+            __m256i hi = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(shi, ahi),
+                                 _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(ff, ahi))),
+                half);
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+            d = _mm256_packus_epi16(lo, hi);
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), swap ? _mm256_shuffle_epi8(d, rb) : d);
+    }
+    _mm256_zeroupper();
+    over_span_scalar(out + i, dst + i, src + i, n - i, swap);
+}
+
+/* the alpha differs per pixel, four at a time: mask * a / 255 in 16 bit
+ * words, each spread over the four words of its pixel. a pixel with mask
+ * 0 gets alpha 0 and blends to dst unchanged. text is only ever a few
+ * rows of a few hundred pixels, so there is no avx2 variant */
+
+__attribute__((target("sse2")))
+static void mask_span_sse2(argb *dst, argb color, const uint8_t *mask,
+                           int n, bool blend) {
+    int i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ff = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    const __m128i ca = _mm_set1_epi16((short)(color >> 24));
+    const __m128i rgb = _mm_set1_epi32((int)(color & 0x00FFFFFF));
+    /* src alpha counts as 255 */
+    const __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32((int)(color | 0xFF000000)), zero);
+    for (; i + 4 <= n; i += 4) {
+        uint32_t m4;
+        memcpy(&m4, mask + i, sizeof(m4));
+        if (m4 == 0)
+            continue;
+        __m128i m = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)m4), zero);
+        __m128i a = _mm_add_epi16(_mm_mullo_epi16(m, ca), half);
+        a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+        __m128i d = _mm_loadu_si128((__m128i *)(dst + i));
+        if (!blend) {
+            __m128i c = _mm_or_si128(rgb, _mm_slli_epi32(_mm_unpacklo_epi16(a, zero), 24));
+            __m128i keep = _mm_cmpeq_epi32(_mm_unpacklo_epi16(m, zero), zero);
+            d = _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, c));
+            _mm_storeu_si128((__m128i *)(dst + i), d);
+            continue;
+        }
+        __m128i aa = _mm_unpacklo_epi16(a, a);
+        __m128i alo = _mm_unpacklo_epi32(aa, aa);
+        __m128i ahi = _mm_unpackhi_epi32(aa, aa);
+        __m128i lo = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s, alo),
+                          _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(ff, alo))),
+            half);
+        __m128i hi = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s, ahi),
+                          _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(ff, ahi))),
+            half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    mask_span_scalar(dst + i, color, mask + i, n - i, blend);
+}
+
+/* |px - ref| per byte is subs(px, ref) | subs(ref, px), the pixel matches
+ * when that minus tolerance, saturated, is zero in all four bytes */
+
+__attribute__((target("sse2")))
+static int match_span_sse2(const argb *px, int n, argb ref, int tolerance,
+                           bool want) {
+    int i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i r = _mm_set1_epi32((int)ref);
+    const __m128i t = _mm_set1_epi8((char)tolerance);
+    const int all = want ? 0xF : 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(px + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(p, r), _mm_subs_epu8(r, p));
+        __m128i m = _mm_cmpeq_epi32(_mm_subs_epu8(d, t), zero);
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(m));
+        if (bits != all)
+            return i + __builtin_ctz(bits ^ all);
+    }
+    return i + match_span_scalar(px + i, n - i, ref, tolerance, want);
+}
+
+__attribute__((target("avx2")))
+static int match_span_avx2(const argb *px, int n, argb ref, int tolerance,
+                           bool want) {
+    int i = 0;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i r = _mm256_set1_epi32((int)ref);
+    const __m256i t = _mm256_set1_epi8((char)tolerance);
+    const int all = want ? 0xFF : 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(px + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(p, r), _mm256_subs_epu8(r, p));
+        __m256i m = _mm256_cmpeq_epi32(_mm256_subs_epu8(d, t), zero);
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+        if (bits != all) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(bits ^ all);
+        }
+    }
+    _mm256_zeroupper();
+    return i + match_span_scalar(px + i, n - i, ref, tolerance, want);
+}
+
+#endif /* BLEND_X86 */
+
+void (*blend_span)(argb *dst, argb src, int n) = blend_span_scalar;
+void (*set_span)(argb *dst, argb c, int n) = set_span_scalar;
+void (*over_span)(argb *out, const argb *dst, const argb *src, int n,
+                  bool swap_rb) = over_span_scalar;
+void (*mask_span)(argb *dst, argb color, const uint8_t *mask, int n,
+                  bool blend) = mask_span_scalar;
+int (*match_span)(const argb *px, int n, argb ref, int tolerance,
+                  bool want) = match_span_scalar;
+static const char *kernel_name = "scalar";
+
+void blend_init(void) {
+    blend_span = blend_span_scalar;
+    set_span = set_span_scalar;
+    over_span = over_span_scalar;
+    mask_span = mask_span_scalar;
+    match_span = match_span_scalar;
+    kernel_name = "scalar";
+#ifdef BLEND_X86
+    if (SDL_HasAVX2()) {
+        blend_span = blend_span_avx2;
+        set_span = set_span_avx2;
+        over_span = over_span_avx2;
+        mask_span = mask_span_sse2;
+        match_span = match_span_avx2;
+        kernel_name = "avx2";
+    } else if (SDL_HasSSE2()) {
+        blend_span = blend_span_sse2;
+        set_span = set_span_sse2;
+        over_span = over_span_sse2;
+        mask_span = mask_span_sse2;
+        match_span = match_span_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *blend_kernel_name(void) {
+    return kernel_name;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#ifndef SDRAW_BLEND_H
+#define SDRAW_BLEND_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "layer.h"
+
+/* source-over compositing of non-premultiplied ARGB8888.
+ * with a = alpha of src, every channel c (alpha counted as a channel
+ * whose src value is 255) becomes
+ *     c = (src_c * a + dst_c * (255 - a)) / 255
+ * rounded to nearest, so a = 255 gives src and a = 0 leaves dst as is */
+
+/* x / 255 rounded, exact for 0 <= x <= 255 * 255 */
+#define DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+
+static inline argb blend_pixel(argb dst, argb src) {
+    uint32_t a = src >> 24, ia = 255 - a;
+    /* red and blue, then alpha and green, two channels per 32 bit word */
+    uint32_t rb = (src & 0x00FF00FF) * a + (dst & 0x00FF00FF) * ia + 0x00800080;
+    uint32_t ag = (((src | 0xFF000000) >> 8) & 0x00FF00FF) * a +
+                  ((dst >> 8) & 0x00FF00FF) * ia + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ag = (ag + ((ag >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+    return ag | rb;
+}
+
+/* ARGB <-> ABGR */
+static inline argb argb_swap_rb(argb c) {
+    return (c & 0xFF00FF00) | ((c >> 16) & 0xFF) | ((c & 0xFF) << 16);
+}
+
+/* blend src over the n pixels at dst. points to the fastest variant the
+ * cpu supports once blend_init has run, scalar before that */
+extern void (*blend_span)(argb *dst, argb src, int n);
+/* store c into the n pixels at dst, same dispatch as blend_span */
+extern void (*set_span)(argb *dst, argb c, int n);
+/* out[i] = blend_pixel(dst[i], src[i]) for n pixels, with swap_rb the
+ * red and blue bytes of the result trade places (for ABGR output) */
+extern void (*over_span)(argb *out, const argb *dst, const argb *src, int n,
+                         bool swap_rb);
+
+/* color with its alpha scaled by mask[i] / 255, for the n pixels at dst.
+ * blended over them with blend, stored otherwise. pixels whose mask is 0
+ * are left alone either way */
+extern void (*mask_span)(argb *dst, argb color, const uint8_t *mask, int n,
+                         bool blend);
+
+/* whether every channel of a is within tolerance of the same channel of
+ * b, tolerance 0 means exact match */
+static inline bool color_match(argb a, argb b, int tolerance) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        int d = (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+        if (d > tolerance || d < -tolerance)
+            return false;
+    }
+    return true;
+}
+
+/* how many of the n pixels at px, from the start, have
+ * color_match(px[i], ref, tolerance) == want */
+extern int (*match_span)(const argb *px, int n, argb ref, int tolerance,
+                         bool want);
+
+/* pick kernels by cpuid, call once at startup */
+void blend_init(void);
+/* "scalar", "sse2" or "avx2" */
+const char *blend_kernel_name(void);
+
+#endif
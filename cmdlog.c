@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "cmdlog.h"
+
+#define TILE_BYTES (TILE_PIXELS * sizeof(argb))
+
+/* keyframe tile, shared by every keyframe it did not change between */
+struct cmdlog_tile {
+    int refs;
+    argb px[TILE_PIXELS];
+};
+
+void cmdlog_op_free(cmdlog_op_t *op) {
+    arrfree(op->xy);
+    arrfree(op->chunks);
+    free(op->text);
+    free(op->font);
+    memset(op, 0, sizeof(*op));
+}
+
+static int ntiles(const cmdlog_t *log) {
+    return log->layer->tw * log->layer->th;
+}
+
+static void key_free(cmdlog_t *log, cmdlog_key_t *key) {
+    for (int i = 0; i < ntiles(log); i++)
+        if (key->tiles[i] != NULL && --key->tiles[i]->refs == 0)
+            free(key->tiles[i]);
+    free(key->tiles);
+    key->tiles = NULL;
+}
+
+/* layer hook */
+static void touch(void *data, layer_t *layer, int tile) {
+    cmdlog_t *log = data;
+    (void)layer;
+    log->wrote = true;
+    if (log->touched[tile])
+        return;
+    log->touched[tile] = 1;
+    arrpush(log->touched_list, tile);
+}
+
+static void clear_touched(cmdlog_t *log) {
+    for (size_t i = 0; i < arrlen(log->touched_list); i++)
+        log->touched[log->touched_list[i]] = 0;
+    if (log->touched_list != NULL)
+        arrsetlen(log->touched_list, 0);
+}
+
+/* keyframe of the layer as it is now, at pos. tiles untouched since
+ * keys[base] are taken from it instead of copied */
+static void key_take(cmdlog_t *log) {
+    const layer_t *layer = log->layer;
+    cmdlog_key_t key = {log->pos, calloc(ntiles(log), sizeof(*key.tiles))};
+    if (key.tiles == NULL)
+        panic("Failed to allocate memory for undo keyframe");
+    const cmdlog_key_t *prev = arrlen(log->keys) ? &log->keys[log->base] : NULL;
+    for (int i = 0; i < ntiles(log); i++) {
+        if (prev != NULL && !log->touched[i]) {
+            key.tiles[i] = prev->tiles[i];
+            if (key.tiles[i] != NULL)
+                key.tiles[i]->refs++;
+        } else if (layer->tiles[i] != NULL) {
+            key.tiles[i] = malloc(sizeof(struct cmdlog_tile));
+            if (key.tiles[i] == NULL)
+                panic("Failed to allocate memory for undo keyframe");
+            key.tiles[i]->refs = 1;
+            memcpy(key.tiles[i]->px, layer->tiles[i], TILE_BYTES);
+        }
+    }
+    arrpush(log->keys, key);
+    log->base = arrlen(log->keys) - 1;
+    clear_touched(log);
+}
+
+/* tile i of the layer back to what it is in key. with compare, a tile
+ * that is the same already is left alone, so it is not marked dirty */
+static void restore_tile(cmdlog_t *log, const cmdlog_key_t *key, int i,
+                         bool compare) {
+    layer_t *layer = log->layer;
+    const struct cmdlog_tile *t = key->tiles[i];
+    const int tx = i % layer->tw, ty = i / layer->tw;
+    if (t == NULL) {
+        argb *pixels = NULL;
+        if (layer->tiles[i] != NULL) {
+            layer_swap_tile(layer, tx, ty, &pixels);
+            free(pixels);
+        }
+        return;
+    }
+    if (compare && layer->tiles[i] != NULL &&
+        memcmp(layer->tiles[i], t->px, TILE_BYTES) == 0)
+        return;
+    memcpy(layer_tile_w(layer, tx, ty), t->px, TILE_BYTES);
+}
+
+/* make the layer what it was at op `target`, from the last keyframe at
+ * or before it. from keys[base] only the touched tiles have to be put
+ * back, from any other every tile is compared */
+static void seek(cmdlog_t *log, size_t target) {
+    size_t k = arrlen(log->keys) - 1;
+    while (log->keys[k].at > target)
+        k--;
+    if (k == log->base) {
+        for (size_t i = 0; i < arrlen(log->touched_list); i++)
+            restore_tile(log, &log->keys[k], log->touched_list[i], false);
+    } else {
+        for (int i = 0; i < ntiles(log); i++)
+            restore_tile(log, &log->keys[k], i, true);
+    }
+    log->base = k;
+    clear_touched(log);
+    for (size_t i = log->keys[k].at; i < target; i++)
+        log->replay(log->data, &log->ops[i]);
+    log->pos = target;
+}
+
+void cmdlog_init(cmdlog_t *log, layer_t *layer, int interval,
+                 void (*replay)(void *data, const cmdlog_op_t *op),
+                 void *data) {
+    memset(log, 0, sizeof(*log));
+    log->layer = layer;
+    log->interval = interval > 0 ? interval : 1;
+    log->replay = replay;
+    log->data = data;
+    log->touched = calloc(ntiles(log), 1);
+    if (log->touched == NULL)
+        panic("Failed to allocate memory for undo");
+    layer->before_write = touch;
+    layer->before_write_data = log;
+}
+
+void cmdlog_free(cmdlog_t *log) {
+    for (size_t i = 0; i < arrlen(log->ops); i++)
+        cmdlog_op_free(&log->ops[i]);
+    for (size_t i = 0; i < arrlen(log->keys); i++)
+        key_free(log, &log->keys[i]);
+    arrfree(log->ops);
+    arrfree(log->keys);
+    arrfree(log->touched_list);
+    free(log->touched);
+    log->ops = NULL;
+    log->keys = NULL;
+    log->touched_list = NULL;
+    log->touched = NULL;
+    log->layer->before_write = NULL;
+    log->layer->before_write_data = NULL;
+}
+
+void cmdlog_begin(cmdlog_t *log) {
+    if (log->open)
+        return;
+    /* the first keyframe is taken this late so that whatever was put on
+     * the layer before any operation, like a loaded image, is in it */
+    if (arrlen(log->keys) == 0)
+        key_take(log);
+    log->open = true;
+    log->wrote = false;
+}
+
+void cmdlog_end(cmdlog_t *log, cmdlog_op_t *op) {
+    if (!log->open) {
+        cmdlog_op_free(op);
+        return;
+    }
+    log->open = false;
+    if (!log->wrote) {
+        cmdlog_op_free(op);
+        return;
+    }
+    /* a new operation ends what could be redone */
+    for (size_t i = log->pos; i < arrlen(log->ops); i++)
+        cmdlog_op_free(&log->ops[i]);
+    if (log->ops != NULL)
+        arrsetlen(log->ops, log->pos);
+    while (arrlen(log->keys) > 0 && arrback(log->keys).at > log->pos) {
+        key_free(log, &arrback(log->keys));
+        arrsetlen(log->keys, arrlen(log->keys) - 1);
+    }
+    arrpush(log->ops, *op);
+    memset(op, 0, sizeof(*op));
+    log->pos++;
+    if (log->pos % log->interval == 0)
+        key_take(log);
+}
+
+bool cmdlog_undo(cmdlog_t *log) {
+    if (log->open || log->pos == 0)
+        return false;
+    seek(log, log->pos - 1);
+    return true;
+}
+
+bool cmdlog_redo(cmdlog_t *log) {
+    if (log->open || log->pos == arrlen(log->ops))
+        return false;
+    log->replay(log->data, &log->ops[log->pos++]);
+    return true;
+}
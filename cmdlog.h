@@ -0,0 +1,75 @@
+#pragma once
+
+#ifndef SDRAW_CMDLOG_H
+#define SDRAW_CMDLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "layer.h"
+
+/* one drawing operation, as much as it takes to draw it again. which
+ * fields mean something depends on the tool */
+typedef struct {
+    int tool;
+    argb fg;
+    int brushsize;
+    int tolerance;
+    bool global;
+    /* points (dynarray), x and y after each other */
+    int *xy;
+    /* brush: the stroke was drawn as polylines ending at these points
+     * (dynarray), each starting where the one before ended */
+    int *chunks;
+    char *text, *font;
+    int font_size;
+} cmdlog_op_t;
+
+void cmdlog_op_free(cmdlog_op_t *op);
+
+/* a layer's state at one point of the log. tiles is tw * th, NULL for
+ * clear ones. tiles nothing wrote to between two keyframes are shared */
+typedef struct {
+    size_t at;
+    struct cmdlog_tile **tiles;
+} cmdlog_key_t;
+
+/* undo by operation instead of by pixels. every operation is kept as a
+ * cmdlog_op_t, and every `interval` operations the whole layer as a
+ * keyframe. undo goes back to the nearest keyframe and draws the
+ * operations after it again with `replay`, redo just draws the next one */
+typedef struct {
+    layer_t *layer;
+    int interval;
+    void (*replay)(void *data, const cmdlog_op_t *op);
+    void *data;
+    /* dynarray, ops[0..pos) are drawn */
+    cmdlog_op_t *ops;
+    size_t pos;
+    /* dynarray, by `at`. keys[base] is what the layer was last made
+     * from, touched[i] set (and i in touched_list) for every tile
+     * written since */
+    cmdlog_key_t *keys;
+    size_t base;
+    uint8_t *touched;
+    int *touched_list;
+    /* inside an operation, and whether it wrote anything yet */
+    bool open, wrote;
+} cmdlog_t;
+
+void cmdlog_init(cmdlog_t *log, layer_t *layer, int interval,
+                 void (*replay)(void *data, const cmdlog_op_t *op),
+                 void *data);
+void cmdlog_free(cmdlog_t *log);
+
+/* around the drawing of an operation, cmdlog_end takes op over. one
+ * that wrote nothing is not kept */
+void cmdlog_begin(cmdlog_t *log);
+void cmdlog_end(cmdlog_t *log, cmdlog_op_t *op);
+
+/* false when there is nothing to undo (redo) or an operation is open */
+bool cmdlog_undo(cmdlog_t *log);
+bool cmdlog_redo(cmdlog_t *log);
+
+#endif
@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "blend.h"
+#include "fill.h"
+
+/* canvases smaller than this are filled on the calling thread only */
+#define FILL_PARALLEL_PIXELS (4 << 20)
+#define FILL_MAX_THREADS 16
+
+/* run of row y, x1..x2 inclusive, whose neighbours on row y + dy are
+ * still to be looked at */
+typedef struct {
+    int y, x1, x2, dy;
+} fill_seg_t;
+
+/* run of row y, x1..x2 inclusive, that belongs to the region */
+typedef struct {
+    int y, x1, x2;
+} fill_run_t;
+
+enum {
+    FILL_SEARCH,
+    FILL_GLOBAL,
+    FILL_PAINT,
+    FILL_QUIT,
+};
+
+typedef struct fill_job_s fill_job_t;
+
+/* rows y1 .. y2-1 of the layer. bands start on tile boundaries, so every
+ * tile belongs to exactly one band and bands never write the same memory */
+typedef struct {
+    fill_job_t *job;
+    int y1, y2;
+    fill_seg_t *stack;     /* segs to look at, their next row is in this band */
+    fill_seg_t *up, *down; /* segs whose next row is in the band above/below */
+    fill_run_t *runs;
+    SDL_Thread *thread;
+    SDL_sem *start, *done;
+} fill_band_t;
+
+struct fill_job_s {
+    layer_t *layer;
+    argb old, color;
+    int tolerance;
+    bool blend;
+    /* one bit per pixel, set on the first pixel of every run found. runs
+     * are maximal, so that is enough to tell a run was seen. rows are
+     * padded to whole bytes so bands never share a byte */
+    uint8_t *visited;
+    size_t stride;
+    int phase;
+    fill_band_t bands[FILL_MAX_THREADS];
+    int nbands;
+};
+
+/* first x in x..limit-1 where color_match(pixel, job->old) != want,
+ * or limit */
+static int scan_right(const fill_job_t *job, int x, int y, int limit,
+                      bool want) {
+    const layer_t *layer = job->layer;
+    while (x < limit) {
+        int n;
+        const argb *px = layer_span(layer, x, y, &n);
+        n = n < limit - x ? n : limit - x;
+        if (layer->tiles[(y >> TILE_SHIFT) * layer->tw + (x >> TILE_SHIFT)] == NULL) {
+            /* untouched tile, the whole span is `clear` */
+            if (color_match(layer->clear, job->old, job->tolerance) != want)
+                return x;
+            x += n;
+            continue;
+        }
+        int i = match_span(px, n, job->old, job->tolerance, want);
+        if (i < n)
+            return x + i;
+        x += n;
+    }
+    return limit;
+}
+
+/* last x in 0..x where everything from it up to x matches job->old */
+static int scan_left(const fill_job_t *job, int x, int y) {
+    while (x > 0) {
+        /* pixels left of x inside its tile */
+        int n = x & TILE_MASK;
+        if (n == 0)
+            n = x < TILE_SIZE ? x : TILE_SIZE;
+        int dummy;
+        const argb *px = layer_span(job->layer, x - n, y, &dummy);
+        int i = n;
+        while (i > 0 && color_match(px[i - 1], job->old, job->tolerance))
+            i--;
+        if (i > 0)
+            return x - n + i;
+        x -= n;
+    }
+    return 0;
+}
+
+static bool test_and_set_visited(fill_job_t *job, int x, int y) {
+    uint8_t *byte = &job->visited[y * job->stride + (x >> 3)];
+    uint8_t bit = 1 << (x & 7);
+    if (*byte & bit)
+        return true;
+    *byte |= bit;
+    return false;
+}
+
+static void push_seg(fill_band_t *band, int y, int x1, int x2, int dy) {
+    int ny = y + dy;
+    fill_seg_t seg = {y, x1, x2, dy};
+    if (ny < 0 || ny >= band->job->layer->h)
+        return;
+    if (ny < band->y1)
+        arrpush(band->up, seg);
+    else if (ny >= band->y2)
+        arrpush(band->down, seg);
+    else
+        arrpush(band->stack, seg);
+}
+
+/* run through the seg stack until it is empty, only reading the layer */
+static void band_search(fill_band_t *band) {
+    fill_job_t *job = band->job;
+    const layer_t *layer = job->layer;
+    while (arrlen(band->stack) > 0) {
+        fill_seg_t seg = arrpop(band->stack);
+        int ny = seg.y + seg.dy;
+        int nx = seg.x1;
+        while (nx <= seg.x2) {
+            /* find next run of old on row ny touching seg */
+            nx = scan_right(job, nx, ny, seg.x2 + 1, false);
+            if (nx > seg.x2)
+                break;
+            int a = nx == seg.x1 ? scan_left(job, nx, ny) : nx;
+            int b = scan_right(job, nx, ny, layer->w, true) - 1;
+            if (!test_and_set_visited(job, a, ny)) {
+                fill_run_t run = {ny, a, b};
+                arrpush(band->runs, run);
+                push_seg(band, ny, a, b, seg.dy);
+                /* run sticks out past seg, go back around the corner */
+                if (a < seg.x1 - 1)
+                    push_seg(band, ny, a, seg.x1 - 2, -seg.dy);
+                if (b > seg.x2 + 1)
+                    push_seg(band, ny, seg.x2 + 2, b, -seg.dy);
+            }
+            nx = b + 2;
+        }
+    }
+}
+
+/* every run of matching pixels on the band's rows, connected or not.
+ * walks tile by tile rather than row by row, so each tile is read as one
+ * block instead of 64 strided pieces. runs end at tile edges */
+static void band_search_global(fill_band_t *band) {
+    const layer_t *layer = band->job->layer;
+    for (int ty = band->y1 >> TILE_SHIFT; ty << TILE_SHIFT < band->y2; ty++) {
+        int yend = (ty + 1) * TILE_SIZE < band->y2 ? (ty + 1) * TILE_SIZE : band->y2;
+        for (int tx = 0; tx < layer->tw; tx++) {
+            int xend = (tx + 1) * TILE_SIZE < layer->w ? (tx + 1) * TILE_SIZE : layer->w;
+            for (int y = ty * TILE_SIZE; y < yend; y++) {
+                int x = scan_right(band->job, tx * TILE_SIZE, y, xend, false);
+                while (x < xend) {
+                    int end = scan_right(band->job, x, y, xend, true);
+                    fill_run_t run = {y, x, end - 1};
+                    arrpush(band->runs, run);
+                    x = scan_right(band->job, end, y, xend, false);
+                }
+            }
+        }
+    }
+}
+
+/* tiles of the runs are already allocated and marked by fill_flood, so
+ * this writes straight into them without touching anything shared */
+static void band_paint(fill_band_t *band) {
+    layer_t *layer = band->job->layer;
+    const argb color = band->job->color;
+    for (size_t i = 0; i < arrlen(band->runs); i++) {
+        fill_run_t run = band->runs[i];
+        for (int x = run.x1; x <= run.x2;) {
+            int n = TILE_SIZE - (x & TILE_MASK);
+            n = n < run.x2 - x + 1 ? n : run.x2 - x + 1;
+            argb *px = layer->tiles[(run.y >> TILE_SHIFT) * layer->tw +
+                                    (x >> TILE_SHIFT)] +
+                       (run.y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+            if (band->job->blend)
+                blend_span(px, color, n);
+            else
+                set_span(px, color, n);
+            x += n;
+        }
+    }
+}
+
+/* false for FILL_QUIT */
+static bool band_run(fill_band_t *band, int phase) {
+    switch (phase) {
+    case FILL_SEARCH:
+        band_search(band);
+        break;
+    case FILL_GLOBAL:
+        band_search_global(band);
+        break;
+    case FILL_PAINT:
+        band_paint(band);
+        break;
+    case FILL_QUIT:
+        return false;
+    }
+    return true;
+}
+
+static int band_worker(void *data) {
+    fill_band_t *band = data;
+    while (true) {
+        SDL_SemWait(band->start);
+        if (!band_run(band, band->job->phase))
+            return 0;
+        SDL_SemPost(band->done);
+    }
+}
+
+/* run the current phase on every band that has work, wait for all */
+static void run_phase(fill_job_t *job, int phase) {
+    job->phase = phase;
+    if (job->nbands == 1) {
+        band_run(&job->bands[0], phase);
+        return;
+    }
+    bool started[FILL_MAX_THREADS];
+    for (int i = 0; i < job->nbands; i++) {
+        started[i] = phase != FILL_SEARCH || arrlen(job->bands[i].stack) > 0;
+        if (started[i])
+            SDL_SemPost(job->bands[i].start);
+    }
+    for (int i = 0; i < job->nbands; i++)
+        if (started[i])
+            SDL_SemWait(job->bands[i].done);
+}
+
+/* hand segs that left a band over to their band, false once there are
+ * none left anywhere */
+static bool exchange_segs(fill_job_t *job) {
+    bool any = false;
+    for (int i = 0; i < job->nbands; i++) {
+        fill_band_t *band = &job->bands[i];
+        for (size_t j = 0; j < arrlen(band->up); j++)
+            arrpush(job->bands[i - 1].stack, band->up[j]);
+        for (size_t j = 0; j < arrlen(band->down); j++)
+            arrpush(job->bands[i + 1].stack, band->down[j]);
+        if (band->up != NULL)
+            arrsetlen(band->up, 0);
+        if (band->down != NULL)
+            arrsetlen(band->down, 0);
+    }
+    for (int i = 0; i < job->nbands; i++)
+        any = any || arrlen(job->bands[i].stack) > 0;
+    return any;
+}
+
+static int band_count(const layer_t *layer) {
+    if ((long long)layer->w * layer->h < FILL_PARALLEL_PIXELS)
+        return 1;
+    int n = SDL_GetCPUCount();
+    n = n < FILL_MAX_THREADS ? n : FILL_MAX_THREADS;
+    n = n < layer->th ? n : layer->th;
+    return n > 1 ? n : 1;
+}
+
+/* stop the band threads and free their semaphores, whichever of them
+ * were made */
+static void bands_stop(fill_job_t *job) {
+    job->phase = FILL_QUIT;
+    for (int i = 0; i < job->nbands; i++) {
+        fill_band_t *band = &job->bands[i];
+        if (band->thread != NULL) {
+            SDL_SemPost(band->start);
+            SDL_WaitThread(band->thread, NULL);
+        }
+        if (band->start != NULL)
+            SDL_DestroySemaphore(band->start);
+        if (band->done != NULL)
+            SDL_DestroySemaphore(band->done);
+        band->thread = NULL;
+        band->start = band->done = NULL;
+    }
+}
+
+static bool job_begin(fill_job_t *job, layer_t *layer, argb old, argb color,
+                      int tolerance, bool blend) {
+    memset(job, 0, sizeof(*job));
+    job->layer = layer;
+    job->old = old;
+    job->color = color;
+    job->tolerance = tolerance;
+    job->blend = blend;
+    /* nothing would change */
+    if (blend ? (color >> 24) == 0 : tolerance == 0 && old == color)
+        return false;
+
+    job->nbands = band_count(layer);
+    int tiles_per_band = (layer->th + job->nbands - 1) / job->nbands;
+    for (int i = 0; i < job->nbands; i++) {
+        fill_band_t *band = &job->bands[i];
+        band->job = job;
+        band->y1 = i * tiles_per_band * TILE_SIZE;
+        band->y2 = (i + 1) * tiles_per_band * TILE_SIZE;
+        band->y2 = band->y2 < layer->h ? band->y2 : layer->h;
+        if (job->nbands > 1) {
+            band->start = SDL_CreateSemaphore(0);
+            band->done = SDL_CreateSemaphore(0);
+            if (band->start != NULL && band->done != NULL)
+                band->thread = SDL_CreateThread(band_worker, "fill", band);
+            if (band->thread == NULL) {
+                /* run_phase would wait on it for ever, fill on this
+                 * thread alone instead */
+                warn("Failed to start flood fill thread: %s", SDL_GetError());
+                job->nbands = i + 1;
+                bands_stop(job);
+                job->nbands = 1;
+                job->bands[0].y2 = layer->h;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+/* paint every run found and tear the job down */
+static void job_finish(fill_job_t *job) {
+    /* allocate and mark every tile here, on this thread, then let the
+     * bands paint their own tiles */
+    for (int i = 0; i < job->nbands; i++) {
+        fill_band_t *band = &job->bands[i];
+        for (size_t j = 0; j < arrlen(band->runs); j++) {
+            fill_run_t r = band->runs[j];
+            for (int tx = r.x1 >> TILE_SHIFT; tx <= r.x2 >> TILE_SHIFT; tx++)
+                layer_tile_w(job->layer, tx, r.y >> TILE_SHIFT);
+        }
+    }
+    run_phase(job, FILL_PAINT);
+
+    bands_stop(job);
+    for (int i = 0; i < job->nbands; i++) {
+        fill_band_t *band = &job->bands[i];
+        arrfree(band->stack);
+        arrfree(band->up);
+        arrfree(band->down);
+        arrfree(band->runs);
+    }
+    free(job->visited);
+}
+
+void fill_flood(layer_t *layer, int x, int y, argb color, int tolerance,
+                bool blend) {
+    fill_job_t job;
+    if (!job_begin(&job, layer, layer_get(layer, x, y), color, tolerance, blend))
+        return;
+    job.stride = (layer->w + 7) / 8;
+    job.visited = calloc(job.stride * layer->h, 1);
+    if (job.visited == NULL) {
+        warn("Failed to allocate memory for flood fill");
+        job_finish(&job);
+        return;
+    }
+
+    /* seed run */
+    int tiles_per_band = (layer->th + job.nbands - 1) / job.nbands;
+    fill_band_t *seed = &job.bands[(y >> TILE_SHIFT) / tiles_per_band];
+    int x1 = scan_left(&job, x, y);
+    int x2 = scan_right(&job, x, y, layer->w, true) - 1;
+    fill_run_t run = {y, x1, x2};
+    test_and_set_visited(&job, x1, y);
+    arrpush(seed->runs, run);
+    push_seg(seed, y, x1, x2, 1);
+    push_seg(seed, y, x1, x2, -1);
+
+    /* bands search in parallel, then swap the segs that crossed into a
+     * neighbour, until nothing crosses. the region found is the same
+     * whatever the order, so the result matches a serial fill exactly */
+    exchange_segs(&job);
+    do {
+        run_phase(&job, FILL_SEARCH);
+    } while (exchange_segs(&job));
+
+    job_finish(&job);
+}
+
+void fill_global(layer_t *layer, argb ref, argb color, int tolerance,
+                 bool blend) {
+    fill_job_t job;
+    if (!job_begin(&job, layer, ref, color, tolerance, blend))
+        return;
+    run_phase(&job, FILL_GLOBAL);
+    job_finish(&job);
+}
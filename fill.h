@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef SDRAW_FILL_H
+#define SDRAW_FILL_H
+
+#include <stdbool.h>
+
+#include "layer.h"
+
+/* scanline seed fill: paint `color` over the 4-connected region of pixels
+ * matching the one at x, y. works a whole run of a row at a time, the stack
+ * holds runs still to be looked at, not pixels.
+ * a pixel matches when each of its channels is within `tolerance` of the
+ * seed pixel's (see color_match), with blend color is blended over the
+ * region, otherwise stored as is.
+ * on big layers the rows are split in bands searched and painted by one
+ * thread each, the result is the same as with a single thread */
+void fill_flood(layer_t *layer, int x, int y, argb color, int tolerance,
+                bool blend);
+
+/* like fill_flood but paints every pixel of the layer that matches ref,
+ * connected or not */
+void fill_global(layer_t *layer, argb ref, argb color, int tolerance,
+                 bool blend);
+
+#endif
@@ -4,10 +4,45 @@
 #else
 #include <dirent.h>
 #endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <SDL2/SDL.h>
+
+#include "stb_truetype.h"
+
 #include "log.h"
 #include "dynarray.h"
 #include "font.h"
 
+/* a font file read into memory, for every size opened from it */
+typedef struct {
+    char *path;
+    unsigned char *data;
+    size_t len;
+    stbtt_fontinfo info;
+    int refs;
+} font_file_t;
+
+typedef struct {
+    font_file_t *file;
+    int size;
+    glyph_face_t *face;
+    /* cache.tick when it was last asked for */
+    unsigned long used;
+} font_handle_t;
+
+static struct {
+    size_t budget;
+    unsigned long tick;
+    /* dynarrays */
+    font_file_t **files;
+    font_handle_t *handles;
+} cache;
+
 sdraw_font_t *get_all_fonts() {
     sdraw_font_t *fonts = NULL;
 
@@ -32,8 +67,9 @@ sdraw_font_t *get_all_fonts() {
         FcPatternGetString(fs->fonts[i], FC_STYLE, 0, &style);
         FcPatternGetString(fs->fonts[i], FC_FILE, 0, &path);
 
-        /* SDL_ttf can only handle ttf */
-        if (FcStrStr(path, (const FcChar8*)".ttf") == NULL)
+        /* what stb_truetype can read */
+        if (FcStrStr(path, (const FcChar8*)".ttf") == NULL &&
+            FcStrStr(path, (const FcChar8*)".otf") == NULL)
             continue;
 
         // concat family and style
@@ -63,3 +99,341 @@ int sdraw_font_cmp(const void *a, const void *b) {
     sdraw_font_t *fntb = (sdraw_font_t*)b;
     return strcmp(fnta->name, fntb->name);
 }
+
+/* the font list, found once per process */
+static struct {
+    SDL_Thread *thread;
+    SDL_atomic_t done;
+    /* NULL if there is nowhere to keep the cache file */
+    char *cache_path;
+    sdraw_font_t *fonts;
+} list;
+
+/* the cache file is
+ *     FONT_LIST_MAGIC, dir count, font count (uint32_t)
+ *     per dir: mtime (int64_t), path
+ *     per font: name, path
+ * strings 0 terminated. the dirs are fontconfig's cache and font dirs,
+ * the list is only good while their mtimes are what they were when it
+ * was written. the fonts are sorted already */
+static const char FONT_LIST_MAGIC[8] = "sdrawfl1";
+
+static int64_t dir_mtime(const char *dir) {
+    struct stat st;
+    return stat(dir, &st) == 0 ? (int64_t)st.st_mtime : -1;
+}
+
+static void fonts_free(sdraw_font_t *fonts) {
+    for (size_t i = 0; i < arrlen(fonts); i++) {
+        free(fonts[i].name);
+        free(fonts[i].path);
+    }
+    arrfree(fonts);
+}
+
+/* the 0 terminated string at *p, NULL if it runs past end */
+static char *take_str(const char **p, const char *end) {
+    const char *nul = memchr(*p, '\0', end - *p);
+    if (nul == NULL)
+        return NULL;
+    char *str = strdup(*p);
+    if (str == NULL)
+        panic("Failed to allocate memory for fonts");
+    *p = nul + 1;
+    return str;
+}
+
+static bool take(const char **p, const char *end, void *out, size_t n) {
+    if ((size_t)(end - *p) < n)
+        return false;
+    memcpy(out, *p, n);
+    *p += n;
+    return true;
+}
+
+/* the cached list, false if there is none or it is out of date */
+static bool cache_read(const char *path, sdraw_font_t **fonts) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *data = len > 0 ? malloc(len) : NULL;
+    if (data == NULL || fread(data, 1, len, fp) != (size_t)len) {
+        free(data);
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    const char *p = data, *end = data + len;
+    char magic[sizeof(FONT_LIST_MAGIC)];
+    uint32_t ndirs, nfonts;
+    bool ok = take(&p, end, magic, sizeof(magic)) &&
+              memcmp(magic, FONT_LIST_MAGIC, sizeof(magic)) == 0 &&
+              take(&p, end, &ndirs, sizeof(ndirs)) &&
+              take(&p, end, &nfonts, sizeof(nfonts)) && ndirs > 0;
+    for (uint32_t i = 0; ok && i < ndirs; i++) {
+        int64_t mtime;
+        char *dir = NULL;
+        ok = take(&p, end, &mtime, sizeof(mtime)) &&
+             (dir = take_str(&p, end)) != NULL && dir_mtime(dir) == mtime;
+        free(dir);
+    }
+    for (uint32_t i = 0; ok && i < nfonts; i++) {
+        sdraw_font_t fnt;
+        fnt.name = take_str(&p, end);
+        fnt.path = fnt.name ? take_str(&p, end) : NULL;
+        ok = fnt.path != NULL;
+        if (ok)
+            dynarray_push(*fonts, fnt);
+        else
+            free(fnt.name);
+    }
+    free(data);
+    if (!ok) {
+        fonts_free(*fonts);
+        *fonts = NULL;
+    }
+    return ok;
+}
+
+/* written next to it and renamed over it, so a reader never sees half */
+static void cache_write(const char *path, const sdraw_font_t *fonts,
+                        char **dirs) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        panic("Failed to allocate memory for fonts");
+    snprintf(tmp, len, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        warn("Failed to write font list cache %s", tmp);
+        free(tmp);
+        return;
+    }
+    uint32_t ndirs = arrlen(dirs), nfonts = arrlen(fonts);
+    fwrite(FONT_LIST_MAGIC, sizeof(FONT_LIST_MAGIC), 1, fp);
+    fwrite(&ndirs, sizeof(ndirs), 1, fp);
+    fwrite(&nfonts, sizeof(nfonts), 1, fp);
+    for (size_t i = 0; i < arrlen(dirs); i++) {
+        int64_t mtime = dir_mtime(dirs[i]);
+        fwrite(&mtime, sizeof(mtime), 1, fp);
+        fwrite(dirs[i], strlen(dirs[i]) + 1, 1, fp);
+    }
+    for (size_t i = 0; i < arrlen(fonts); i++) {
+        fwrite(fonts[i].name, strlen(fonts[i].name) + 1, 1, fp);
+        fwrite(fonts[i].path, strlen(fonts[i].path) + 1, 1, fp);
+    }
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+    /* rename does not replace on windows */
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        warn("Failed to write font list cache %s", path);
+        remove(tmp);
+    }
+    free(tmp);
+}
+
+/* fontconfig's cache and font directories (dynarray), as set up by
+ * get_all_fonts */
+static char **fc_dirs(void) {
+    char **dirs = NULL;
+    FcConfig *config = FcConfigGetCurrent();
+    FcStrList *lists[2] = {FcConfigGetCacheDirs(config),
+                           FcConfigGetFontDirs(config)};
+    for (int i = 0; i < 2; i++) {
+        FcChar8 *dir;
+        if (lists[i] == NULL)
+            continue;
+        while ((dir = FcStrListNext(lists[i])) != NULL)
+            dynarray_push(dirs, strdup((char*)dir));
+        FcStrListDone(lists[i]);
+    }
+    return dirs;
+}
+
+static int font_list_thread(void *data) {
+    (void)data;
+    sdraw_font_t *fonts = NULL;
+    if (list.cache_path == NULL || !cache_read(list.cache_path, &fonts)) {
+        fonts = get_all_fonts();
+        qsort(fonts, arrlen(fonts), sizeof(sdraw_font_t), sdraw_font_cmp);
+        /* without any dirs it could never go out of date */
+        char **dirs = fonts != NULL ? fc_dirs() : NULL;
+        if (list.cache_path != NULL && arrlen(dirs) > 0)
+            cache_write(list.cache_path, fonts, dirs);
+        for (size_t i = 0; i < arrlen(dirs); i++)
+            free(dirs[i]);
+        arrfree(dirs);
+    }
+    list.fonts = fonts;
+    SDL_AtomicSet(&list.done, 1);
+    /* wake the event loop, something may be waiting to show them */
+    SDL_Event e = {.type = SDL_USEREVENT};
+    SDL_PushEvent(&e);
+    return 0;
+}
+
+void font_list_init(void) {
+    memset(&list, 0, sizeof(list));
+    char *pref = SDL_GetPrefPath("sdraw", "sdraw");
+    if (pref != NULL) {
+        size_t len = strlen(pref) + sizeof("fonts.cache");
+        list.cache_path = malloc(len);
+        if (list.cache_path == NULL)
+            panic("Failed to allocate memory for fonts");
+        snprintf(list.cache_path, len, "%sfonts.cache", pref);
+        SDL_free(pref);
+    }
+    list.thread = SDL_CreateThread(font_list_thread, "fonts", NULL);
+    if (list.thread == NULL) {
+        warn("Failed to start font thread: %s", SDL_GetError());
+        font_list_thread(NULL);
+    }
+}
+
+bool font_list_get(const sdraw_font_t **fonts) {
+    if (!SDL_AtomicGet(&list.done))
+        return false;
+    if (list.thread != NULL) {
+        SDL_WaitThread(list.thread, NULL);
+        list.thread = NULL;
+    }
+    *fonts = list.fonts;
+    return true;
+}
+
+void font_list_free(void) {
+    if (list.thread != NULL)
+        SDL_WaitThread(list.thread, NULL);
+    fonts_free(list.fonts);
+    free(list.cache_path);
+    memset(&list, 0, sizeof(list));
+}
+
+void font_cache_init(size_t budget) {
+    memset(&cache, 0, sizeof(cache));
+    cache.budget = budget;
+}
+
+static void file_unref(font_file_t *file) {
+    if (--file->refs > 0)
+        return;
+    for (size_t i = 0; i < arrlen(cache.files); i++) {
+        if (cache.files[i] == file) {
+            cache.files[i] = arrback(cache.files);
+            arrsetlen(cache.files, arrlen(cache.files) - 1);
+            break;
+        }
+    }
+    free(file->path);
+    free(file->data);
+    free(file);
+}
+
+static void handle_close(size_t i) {
+    font_handle_t handle = cache.handles[i];
+    cache.handles[i] = arrback(cache.handles);
+    arrsetlen(cache.handles, arrlen(cache.handles) - 1);
+    glyph_face_free(handle.face);
+    free(handle.face);
+    file_unref(handle.file);
+}
+
+void font_cache_free(void) {
+    while (arrlen(cache.handles) > 0)
+        handle_close(arrlen(cache.handles) - 1);
+    arrfree(cache.handles);
+    arrfree(cache.files);
+    memset(&cache, 0, sizeof(cache));
+}
+
+static font_file_t *file_get(const char *path) {
+    for (size_t i = 0; i < arrlen(cache.files); i++)
+        if (strcmp(cache.files[i]->path, path) == 0)
+            return cache.files[i];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    font_file_t *file = calloc(1, sizeof(font_file_t));
+    if (file == NULL || len <= 0 || (file->data = malloc(len)) == NULL ||
+            fread(file->data, 1, len, fp) != (size_t)len) {
+        if (file)
+            free(file->data);
+        free(file);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    file->len = len;
+    int offset = stbtt_GetFontOffsetForIndex(file->data, 0);
+    if (offset < 0 || !stbtt_InitFont(&file->info, file->data, offset)) {
+        free(file->data);
+        free(file);
+        return NULL;
+    }
+    file->path = malloc(strlen(path) + 1);
+    if (file->path == NULL)
+        panic("Failed to allocate memory for font cache");
+    strcpy(file->path, path);
+    arrpush(cache.files, file);
+    return file;
+}
+
+/* the faces' atlases grow as glyphs are drawn, so this is counted anew
+ * every time */
+static size_t cache_bytes(void) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < arrlen(cache.files); i++)
+        bytes += cache.files[i]->len;
+    for (size_t i = 0; i < arrlen(cache.handles); i++)
+        bytes += glyph_face_bytes(cache.handles[i].face);
+    return bytes;
+}
+
+glyph_face_t *font_cache_get(const char *path, int size) {
+    cache.tick++;
+    for (size_t i = 0; i < arrlen(cache.handles); i++) {
+        font_handle_t *handle = &cache.handles[i];
+        if (handle->size == size && strcmp(handle->file->path, path) == 0) {
+            handle->used = cache.tick;
+            return handle->face;
+        }
+    }
+
+    font_file_t *file = file_get(path);
+    if (file == NULL) {
+        warn("Failed to read font file %s", path);
+        return NULL;
+    }
+    file->refs++;
+    glyph_face_t *face = malloc(sizeof(glyph_face_t));
+    if (face == NULL)
+        panic("Failed to allocate memory for font cache");
+    if (!glyph_face_init(face, &file->info, size)) {
+        free(face);
+        file_unref(file);
+        return NULL;
+    }
+    font_handle_t handle = {file, size, face, cache.tick};
+    arrpush(cache.handles, handle);
+
+    /* least recently used first, never the one just opened */
+    while (cache_bytes() > cache.budget && arrlen(cache.handles) > 1) {
+        size_t lru = 0;
+        for (size_t i = 1; i < arrlen(cache.handles); i++)
+            if (cache.handles[i].used < cache.handles[lru].used)
+                lru = i;
+        handle_close(lru);
+    }
+    return face;
+}
@@ -3,6 +3,10 @@
 #ifndef SDRAW_FONT_H
 #define SDRAW_FONT_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "glyph.h"
 
 typedef struct sdraw_font_s {
     char *name;
@@ -13,4 +17,25 @@ sdraw_font_t *get_all_fonts();
 
 int sdraw_font_cmp(const void *a, const void *b);
 
+/* the system's fonts, found on a thread so nothing waits for fontconfig.
+ * the list is kept in a cache file in the pref path and read from there
+ * as long as fontconfig's directories have not changed since. like the
+ * font cache it does not belong to any app */
+void font_list_init(void);
+void font_list_free(void);
+/* false while the fonts are still being found. after, *fonts is them
+ * (dynarray, sorted by name, NULL if there are none), owned by the list */
+bool font_list_get(const sdraw_font_t **fonts);
+
+/* fonts by (path, size), each with the atlas of its glyphs, least
+ * recently used dropped first once they and the files they were read
+ * from take more than budget bytes. one file read is shared by all sizes
+ * of it. it does not belong to any app, so it lives on when the app is
+ * re-created */
+void font_cache_init(size_t budget);
+void font_cache_free(void);
+/* the font, opened if it is not in the cache yet, NULL if it can't be.
+ * owned by the cache, valid until the next font_cache_get */
+glyph_face_t *font_cache_get(const char *path, int size);
+
 #endif
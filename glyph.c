@@ -0,0 +1,277 @@
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NK_INCLUDE_FIXED_TYPES
+#include "nuklear.h"
+/* declarations only, the implementation comes with nuklear's font baking
+ * in main.c */
+#include "stb_truetype.h"
+
+#include "log.h"
+#include "dynarray.h"
+#include "glyph.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static unsigned long last_id;
+
+bool glyph_face_init(glyph_face_t *face, const struct stbtt_fontinfo *info,
+                     int size) {
+    memset(face, 0, sizeof(*face));
+    if (info->numGlyphs <= 0)
+        return false;
+    face->id = ++last_id;
+    face->info = info;
+    face->scale = stbtt_ScaleForMappingEmToPixels(info, size);
+    int ascent, descent, gap, x0, y0, x1, y1;
+    stbtt_GetFontVMetrics(info, &ascent, &descent, &gap);
+    face->ascent = (int)ceilf(ascent * face->scale);
+    face->height = face->ascent - (int)floorf(descent * face->scale);
+    /* same rounding as the glyph bitmap boxes */
+    stbtt_GetFontBoundingBox(info, &x0, &y0, &x1, &y1);
+    face->top = MIN(face->ascent + (int)floorf(-y1 * face->scale), 0);
+    face->bottom = MAX(face->ascent + (int)ceilf(-y0 * face->scale),
+                       face->height);
+    face->nslots = info->numGlyphs;
+    face->slots = calloc(face->nslots, sizeof(*face->slots));
+    /* room for a few rows of 8 or so glyphs before it has to grow */
+    face->atlas_w = 256;
+    while (face->atlas_w < size * 8)
+        face->atlas_w *= 2;
+    face->atlas_h = MAX(face->height, 16);
+    face->atlas = calloc((size_t)face->atlas_w * face->atlas_h, 1);
+    if (face->slots == NULL || face->atlas == NULL)
+        panic("Failed to allocate memory for glyph atlas");
+    return true;
+}
+
+void glyph_face_free(glyph_face_t *face) {
+    arrfree(face->glyphs);
+    free(face->slots);
+    free(face->atlas);
+    memset(face, 0, sizeof(*face));
+}
+
+size_t glyph_face_bytes(const glyph_face_t *face) {
+    return sizeof(*face) + (size_t)face->atlas_w * face->atlas_h +
+           face->nslots * sizeof(*face->slots) +
+           arrlen(face->glyphs) * sizeof(*face->glyphs);
+}
+
+/* a w * h spot in the atlas, a new row when this one is full and twice
+ * the height when there is no row left. the atlas only grows downwards,
+ * so the glyphs already in it keep their place */
+static void atlas_alloc(glyph_face_t *face, int w, int h, int *x, int *y) {
+    if (face->pen_x + w > face->atlas_w) {
+        face->pen_y += face->row_h;
+        face->pen_x = 0;
+        face->row_h = 0;
+    }
+    if (face->pen_y + h > face->atlas_h) {
+        int nh = face->atlas_h;
+        while (face->pen_y + h > nh)
+            nh *= 2;
+        uint8_t *atlas = realloc(face->atlas, (size_t)face->atlas_w * nh);
+        if (atlas == NULL)
+            panic("Failed to allocate memory for glyph atlas");
+        memset(atlas + (size_t)face->atlas_w * face->atlas_h, 0,
+               (size_t)face->atlas_w * (nh - face->atlas_h));
+        face->atlas = atlas;
+        face->atlas_h = nh;
+    }
+    *x = face->pen_x;
+    *y = face->pen_y;
+    face->pen_x += w;
+    face->row_h = MAX(face->row_h, h);
+}
+
+/* where glyph index is in face->glyphs, rasterized on first use */
+static int glyph_slot(glyph_face_t *face, int index) {
+    if (index < 0 || index >= face->nslots)
+        index = 0;
+    if (face->slots[index])
+        return face->slots[index] - 1;
+    glyph_t g = {0};
+    g.index = index;
+    int advance, bearing, x1, y1;
+    stbtt_GetGlyphHMetrics(face->info, index, &advance, &bearing);
+    g.advance = advance * face->scale;
+    stbtt_GetGlyphBitmapBox(face->info, index, face->scale, face->scale,
+                            &g.x0, &g.y0, &x1, &y1);
+    g.w = MIN(x1 - g.x0, face->atlas_w);
+    g.h = y1 - g.y0;
+    if (g.w > 0 && g.h > 0) {
+        atlas_alloc(face, g.w, g.h, &g.ax, &g.ay);
+        stbtt_MakeGlyphBitmap(face->info,
+                              face->atlas + (size_t)g.ay * face->atlas_w + g.ax,
+                              g.w, g.h, face->atlas_w, face->scale,
+                              face->scale, index);
+    } else {
+        g.w = g.h = 0;
+    }
+    arrpush(face->glyphs, g);
+    face->slots[index] = arrlen(face->glyphs);
+    return arrlen(face->glyphs) - 1;
+}
+
+/* run columns from x on (line coordinates) to 0, up to w */
+static void run_clear(glyph_run_t *run, int x, int w) {
+    if (x >= run->x + w)
+        return;
+    x = MAX(x - run->x, 0);
+    for (int y = 0; y < run->h; y++)
+        memset(run->mask + (size_t)y * run->stride + x, 0, w - x);
+}
+
+/* run wide enough for w columns, the stride at least doubled when it
+ * grows so that typing does not copy the run every character */
+static void run_fit(glyph_run_t *run, int w) {
+    if (w <= run->stride)
+        return;
+    int stride = MAX(w, run->stride * 2);
+    uint8_t *mask = calloc((size_t)stride * run->h, 1);
+    if (mask == NULL)
+        panic("Failed to allocate memory for text");
+    for (int y = 0; y < run->h && run->mask != NULL; y++)
+        memcpy(mask + (size_t)y * stride, run->mask + (size_t)y * run->stride,
+               run->stride);
+    free(run->mask);
+    run->mask = mask;
+    run->stride = stride;
+}
+
+/* the columns of a glyph from x on into the run */
+static void run_blit(const glyph_face_t *face, glyph_run_t *run,
+                     const glyph_pos_t *p, int x) {
+    const glyph_t *g = &face->glyphs[p->slot];
+    const int sx = MAX(x - p->x, 0);
+    for (int y = 0; y < g->h; y++) {
+        const int ry = p->y + y - run->y;
+        /* a glyph outside the font's own bounding box */
+        if (ry < 0 || ry >= run->h)
+            continue;
+        const uint8_t *src =
+            face->atlas + (size_t)(g->ay + y) * face->atlas_w + g->ax;
+        uint8_t *dst = run->mask + (size_t)ry * run->stride + p->x - run->x;
+        for (int i = sx; i < g->w; i++)
+            dst[i] = MAX(dst[i], src[i]);
+    }
+}
+
+/* lay the characters of text from byte on out, after the ones in line */
+static void layout(glyph_face_t *face, glyph_line_t *line, const char *text,
+                   int byte) {
+    const int len = strlen(text);
+    while (byte < len) {
+        nk_rune c;
+        int n = nk_utf_decode(text + byte, &c, len - byte);
+        /* cut off in the middle of a character */
+        if (n == 0)
+            break;
+        int index = stbtt_FindGlyphIndex(face->info, c);
+        glyph_char_t ch = {byte, index, line->pen, arrlen(line->pos)};
+        arrpush(line->chars, ch);
+        byte += n;
+        if (line->prev >= 0)
+            line->pen += face->scale *
+                         stbtt_GetGlyphKernAdvance(face->info, line->prev, index);
+        line->prev = index;
+        int slot = glyph_slot(face, index);
+        const glyph_t *g = &face->glyphs[slot];
+        if (g->w > 0) {
+            glyph_pos_t p = {slot, (int)floorf(line->pen + 0.5f) + g->x0,
+                             face->ascent + g->y0};
+            arrpush(line->pos, p);
+        }
+        line->pen += g->advance;
+    }
+    line->bytes = byte;
+    line->width = (int)ceilf(line->pen);
+}
+
+void glyph_line_set(glyph_face_t *face, glyph_line_t *line, const char *text) {
+    size_t keep = 0;
+    int same = 0;
+    if (line->face == face->id && line->text != NULL) {
+        while (line->text[same] != '\0' && line->text[same] == text[same])
+            same++;
+        if (line->text[same] == '\0' && text[same] == '\0')
+            return;
+        /* a character stays if all of it and the byte after it are the
+         * same, a broken one may be decoded differently when that byte
+         * changes. its place only depends on the ones before it */
+        while (keep < arrlen(line->chars) &&
+               (keep + 1 < arrlen(line->chars) ? line->chars[keep + 1].byte
+                                                : line->bytes) < same)
+            keep++;
+    }
+
+    /* columns from x on have to be rendered again, the ones the dropped
+     * glyphs covered and the ones the new glyphs cover */
+    int x = INT_MAX, byte = 0, npos = 0;
+    if (keep == 0) {
+        line->pen = 0;
+        line->prev = -1;
+    } else if (keep < arrlen(line->chars)) {
+        byte = line->chars[keep].byte;
+        npos = line->chars[keep].npos;
+        line->pen = line->chars[keep].pen;
+        line->prev = line->chars[keep - 1].index;
+    } else {
+        byte = line->bytes;
+        npos = arrlen(line->pos);
+    }
+    for (size_t i = npos; i < arrlen(line->pos); i++)
+        x = MIN(x, line->pos[i].x);
+    if (line->chars != NULL)
+        arrsetlen(line->chars, keep);
+    if (line->pos != NULL)
+        arrsetlen(line->pos, npos);
+    layout(face, line, text, byte);
+    for (size_t i = npos; i < arrlen(line->pos); i++)
+        x = MIN(x, line->pos[i].x);
+
+    free(line->text);
+    line->text = malloc(strlen(text) + 1);
+    if (line->text == NULL)
+        panic("Failed to allocate memory for text");
+    strcpy(line->text, text);
+
+    glyph_run_t *run = &line->run;
+    int x2 = 0;
+    for (size_t i = 0; i < arrlen(line->pos); i++)
+        x2 = MAX(x2, line->pos[i].x + face->glyphs[line->pos[i].slot].w);
+    if (keep == 0 || line->face != face->id || x < run->x) {
+        /* everything again, in the same memory if it is as high */
+        if (run->h != face->bottom - face->top) {
+            free(run->mask);
+            memset(run, 0, sizeof(*run));
+            run->h = face->bottom - face->top;
+        }
+        line->face = face->id;
+        run->y = face->top;
+        run->x = 0;
+        for (size_t i = 0; i < arrlen(line->pos); i++)
+            run->x = MIN(run->x, line->pos[i].x);
+        x = run->x;
+    }
+    /* past w the run is kept clear */
+    const int w = MAX(x2 - run->x, 0);
+    run_fit(run, w);
+    run_clear(run, x, MAX(run->w, w));
+    run->w = w;
+    for (size_t i = 0; i < arrlen(line->pos); i++)
+        if (line->pos[i].x + face->glyphs[line->pos[i].slot].w > x)
+            run_blit(face, run, &line->pos[i], x);
+}
+
+void glyph_line_free(glyph_line_t *line) {
+    free(line->text);
+    arrfree(line->chars);
+    arrfree(line->pos);
+    free(line->run.mask);
+    memset(line, 0, sizeof(*line));
+}
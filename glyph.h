@@ -0,0 +1,101 @@
+#pragma once
+
+#ifndef SDRAW_GLYPH_H
+#define SDRAW_GLYPH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct stbtt_fontinfo;
+
+/* a glyph in its face's atlas, w * h at ax, ay. its bitmap goes at x0, y0
+ * from the pen on the baseline */
+typedef struct {
+    int index;
+    int ax, ay, w, h;
+    int x0, y0;
+    float advance;
+} glyph_t;
+
+/* one font at one size. every glyph is rasterized once, into the atlas
+ * (8 bit coverage, atlas_w bytes a row), the first time it is laid out */
+typedef struct {
+    /* different for every face ever made, so a line laid out with one
+     * can tell it is not the face it is given, even at the same address */
+    unsigned long id;
+    const struct stbtt_fontinfo *info;
+    float scale;
+    /* pixels from the top of a line to the baseline, and to the bottom */
+    int ascent, height;
+    /* rows, from the top of a line, that every glyph of the font fits in */
+    int top, bottom;
+    /* dynarray. slots[i] is 1 + where glyph index i is in it, 0 if it is
+     * not rasterized yet */
+    glyph_t *glyphs;
+    int *slots;
+    int nslots;
+    uint8_t *atlas;
+    int atlas_w, atlas_h;
+    /* shelf packing, the next free spot and the height of its row */
+    int pen_x, pen_y, row_h;
+} glyph_face_t;
+
+/* false if the font has no glyphs. info must outlive the face */
+bool glyph_face_init(glyph_face_t *face, const struct stbtt_fontinfo *info,
+                     int size);
+void glyph_face_free(glyph_face_t *face);
+/* memory held by the face */
+size_t glyph_face_bytes(const glyph_face_t *face);
+
+/* a laid out glyph, slot in face->glyphs, x, y the top left of its bitmap
+ * from the top left of the line */
+typedef struct {
+    int slot;
+    int x, y;
+} glyph_pos_t;
+
+/* a character of a laid out line. where it starts in the text, its glyph,
+ * the pen before it (kerning not added yet) and how many glyph_pos_t
+ * come before it */
+typedef struct {
+    int byte;
+    int index;
+    float pen;
+    int npos;
+} glyph_char_t;
+
+/* coverage, h rows of w bytes, stride apart, whose top left is at x, y
+ * from the top left of the line. where glyphs overlap the larger coverage
+ * wins. the rows are as high as the face's glyphs can go, so they do not
+ * change with the text */
+typedef struct {
+    uint8_t *mask;
+    int x, y, w, h, stride;
+} glyph_run_t;
+
+/* a line of text laid out, kept so it is laid out and rendered again
+ * only from the first character that changes. chars and pos are
+ * dynarrays */
+typedef struct {
+    unsigned long face;
+    char *text;
+    /* bytes of text laid out, a character cut off at the end is not */
+    int bytes;
+    glyph_char_t *chars;
+    glyph_pos_t *pos;
+    /* pen and glyph after the last character */
+    float pen;
+    int prev;
+    /* pen at the end, rounded up */
+    int width;
+    glyph_run_t run;
+} glyph_line_t;
+
+/* lay UTF-8 text out as one line and render its coverage into line->run.
+ * what is the same as the text the line was last set to, with the same
+ * face, is kept. a zeroed line is empty */
+void glyph_line_set(glyph_face_t *face, glyph_line_t *line, const char *text);
+void glyph_line_free(glyph_line_t *line);
+
+#endif
@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "history.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define TILE_BYTES (TILE_PIXELS * sizeof(argb))
+
+/* packed runs. every run starts with a word holding its length in
+ * pixels shifted left by 2 and its kind in the low bits, a RUN_SAME run
+ * is followed by its one value and a RUN_LITERAL run by all of them */
+enum {
+    RUN_ZERO,
+    RUN_SAME,
+    RUN_LITERAL,
+};
+
+/* same values in a row worth a run of their own */
+#define MIN_SAME 3
+
+static size_t entry_bytes(const history_entry_t *entry) {
+    size_t bytes = arrlen(entry->tiles) * sizeof(history_tile_t);
+    for (size_t i = 0; i < arrlen(entry->tiles); i++)
+        bytes += entry->tiles[i].size;
+    return bytes;
+}
+
+static void entry_free(history_entry_t *entry) {
+    for (size_t i = 0; i < arrlen(entry->tiles); i++)
+        free(entry->tiles[i].data);
+    arrfree(entry->tiles);
+    entry->tiles = NULL;
+    entry->bytes = 0;
+}
+
+static int same_run(const uint32_t *px, int i, int n) {
+    int j = i + 1;
+    while (j < n && px[j] == px[i])
+        j++;
+    return j - i;
+}
+
+/* code the n words of px into out, which has room for 2 * n. strokes
+ * leave most of a tile's delta zero and fills make long runs of one
+ * value, both come out a few words each */
+static size_t rle_encode(const uint32_t *px, int n, uint32_t *out) {
+    size_t len = 0;
+    for (int i = 0; i < n;) {
+        int run = same_run(px, i, n);
+        if (px[i] == 0) {
+            out[len++] = (uint32_t)run << 2 | RUN_ZERO;
+        } else if (run >= MIN_SAME) {
+            out[len++] = (uint32_t)run << 2 | RUN_SAME;
+            out[len++] = px[i];
+        } else {
+            /* up to the next zero or run long enough to be one */
+            run = 1;
+            while (i + run < n && px[i + run] != 0 &&
+                   same_run(px, i + run, MIN(n, i + run + MIN_SAME)) < MIN_SAME)
+                run++;
+            out[len++] = (uint32_t)run << 2 | RUN_LITERAL;
+            memcpy(out + len, px + i, run * sizeof(uint32_t));
+            len += run;
+        }
+        i += run;
+    }
+    return len;
+}
+
+/* XOR the packed delta into px */
+static void rle_xor(const uint32_t *in, size_t len, uint32_t *px) {
+    for (size_t k = 0; k < len;) {
+        uint32_t run = in[k] >> 2;
+        switch (in[k++] & 3) {
+        case RUN_SAME:
+            for (uint32_t i = 0; i < run; i++)
+                px[i] ^= in[k];
+            k++;
+            break;
+        case RUN_LITERAL:
+            for (uint32_t i = 0; i < run; i++)
+                px[i] ^= in[k + i];
+            k += run;
+            break;
+        }
+        px += run;
+    }
+}
+
+/* turn the tile's copy from before the operation into a packed delta
+ * against the layer, which holds it as it is after it */
+static void pack_tile(const layer_t *layer, history_tile_t *t) {
+    uint32_t delta[TILE_PIXELS], out[2 * TILE_PIXELS];
+    const argb *after = layer->tiles[t->tile];
+    const argb *before = t->data;
+    t->after_clear = after == NULL;
+    if (after == NULL)
+        after = layer->clear_tile;
+    if (before == NULL)
+        before = layer->clear_tile;
+    for (int j = 0; j < TILE_PIXELS; j++)
+        delta[j] = before[j] ^ after[j];
+    size_t len = rle_encode(delta, TILE_PIXELS, out);
+    free(t->data);
+    t->data = malloc(len * sizeof(uint32_t));
+    if (t->data == NULL)
+        panic("Failed to allocate memory for undo");
+    memcpy(t->data, out, len * sizeof(uint32_t));
+    t->size = len * sizeof(uint32_t);
+}
+
+static void pack(const layer_t *layer, history_tile_t *tiles) {
+    for (size_t i = 0; i < arrlen(tiles); i++)
+        pack_tile(layer, &tiles[i]);
+}
+
+/* the worker packs tile by tile, so the ui thread can take one it is
+ * about to write over from under it, see save_tile */
+static int pack_worker(void *data) {
+    history_t *history = data;
+    SDL_LockMutex(history->lock);
+    while (true) {
+        while (arrlen(history->queue) == 0 && !history->quit)
+            SDL_CondWait(history->wake, history->lock);
+        if (arrlen(history->queue) == 0)
+            break;
+        history_tile_t *tiles = history->queue[0];
+        arrdel(history->queue, 0);
+        history->busy = true;
+        for (size_t i = 0; i < arrlen(tiles); i++) {
+            history_tile_t *t = &tiles[i];
+            /* packed by the ui thread already */
+            if (history->unpacked[t->tile] != t)
+                continue;
+            history->unpacked[t->tile] = NULL;
+            history->packing = t->tile;
+            SDL_UnlockMutex(history->lock);
+            pack_tile(history->layer, t);
+            SDL_LockMutex(history->lock);
+            history->packing = -1;
+            SDL_CondSignal(history->idle);
+        }
+        history->busy = false;
+        SDL_CondSignal(history->idle);
+    }
+    SDL_UnlockMutex(history->lock);
+    return 0;
+}
+
+/* the oldest step goes for good */
+static void drop_oldest(history_t *history) {
+    history_entry_t *entry = &history->entries[0];
+    if (history->spilled > 0) {
+        journal_release(&history->journal, entry->end);
+        history->spilled--;
+    } else {
+        history->bytes -= entry->bytes;
+    }
+    entry_free(entry);
+    arrdel(history->entries, 0);
+    history->pos--;
+}
+
+/* move the oldest entry still in memory to the journal, when it is full
+ * the oldest steps in it are dropped to make room */
+static bool spill(history_t *history) {
+    history_entry_t *entry = &history->entries[history->spilled];
+    size_t size = 0;
+    for (size_t i = 0; i < arrlen(entry->tiles); i++)
+        size += entry->tiles[i].size;
+    while (!journal_reserve(&history->journal, size)) {
+        if (history->journal.failed || history->spilled == 0 ||
+            history->pos == 0)
+            return false;
+        drop_oldest(history);
+        entry = &history->entries[history->spilled];
+    }
+    for (size_t i = 0; i < arrlen(entry->tiles); i++) {
+        history_tile_t *t = &entry->tiles[i];
+        t->offset = journal_append(&history->journal, t->data, t->size);
+        free(t->data);
+        t->data = NULL;
+    }
+    entry->end = history->journal.end;
+    history->bytes -= entry->bytes;
+    history->spilled++;
+    return true;
+}
+
+/* wait until the worker packed everything it was given, then count
+ * what the entries hold now and spill the oldest past the budget. only
+ * steps that can be undone are ever dropped, and never the one made
+ * last leaves memory */
+static void settle(history_t *history) {
+    if (history->worker != NULL) {
+        SDL_LockMutex(history->lock);
+        while (arrlen(history->queue) > 0 || history->busy)
+            SDL_CondWait(history->idle, history->lock);
+        SDL_UnlockMutex(history->lock);
+    }
+    const size_t len = arrlen(history->entries);
+    for (size_t i = len - history->unsettled; i < len; i++) {
+        history_entry_t *entry = &history->entries[i];
+        history->bytes -= entry->bytes;
+        entry->bytes = entry_bytes(entry);
+        history->bytes += entry->bytes;
+    }
+    history->unsettled = 0;
+
+    while (history->bytes > history->budget &&
+           history->spilled + 1 < arrlen(history->entries)) {
+        if (spill(history))
+            continue;
+        /* the disk is full, keep the steps in memory over the budget */
+        if (history->journal.failed)
+            break;
+        /* nowhere to put it, the oldest step that can be undone goes */
+        if (history->spilled > 0 || history->pos == 0)
+            break;
+        drop_oldest(history);
+    }
+}
+
+/* when the worker has nothing left, count and spill what it packed.
+ * never waits, so the next operation can start while it is busy */
+static void settle_if_idle(history_t *history) {
+    if (history->worker != NULL) {
+        SDL_LockMutex(history->lock);
+        const bool idle = arrlen(history->queue) == 0 && !history->busy;
+        SDL_UnlockMutex(history->lock);
+        if (!idle)
+            return;
+    }
+    settle(history);
+}
+
+/* layer hook, copies the tile into the open operation the first time
+ * it is about to change. if an earlier operation's copy of it is still
+ * waiting for the worker it has to be packed against the layer first,
+ * here if the worker has not started on it */
+static void save_tile(void *data, layer_t *layer, int tile) {
+    history_t *history = data;
+    if (!history->open || history->saved[tile])
+        return;
+    history->saved[tile] = 1;
+    if (history->worker != NULL) {
+        SDL_LockMutex(history->lock);
+        while (history->packing == tile)
+            SDL_CondWait(history->idle, history->lock);
+        history_tile_t *t = history->unpacked[tile];
+        history->unpacked[tile] = NULL;
+        SDL_UnlockMutex(history->lock);
+        if (t != NULL)
+            pack_tile(layer, t);
+    }
+    history_tile_t t = {.tile = tile, .before_clear = layer->tiles[tile] == NULL};
+    if (!t.before_clear) {
+        t.data = malloc(TILE_BYTES);
+        if (t.data == NULL)
+            panic("Failed to allocate memory for undo");
+        memcpy(t.data, layer->tiles[tile], TILE_BYTES);
+        t.size = TILE_BYTES;
+    }
+    arrpush(history->cur.tiles, t);
+}
+
+void history_init(history_t *history, layer_t *layer, size_t budget,
+                  size_t journal_cap) {
+    memset(history, 0, sizeof(*history));
+    history->layer = layer;
+    history->budget = budget;
+    history->saved = calloc((size_t)layer->tw * layer->th, 1);
+    history->unpacked = calloc((size_t)layer->tw * layer->th,
+                               sizeof(*history->unpacked));
+    if (history->saved == NULL || history->unpacked == NULL)
+        panic("Failed to allocate memory for undo");
+    history->packing = -1;
+    layer->before_write = save_tile;
+    layer->before_write_data = history;
+    journal_open(&history->journal, journal_cap);
+    history->lock = SDL_CreateMutex();
+    history->wake = SDL_CreateCond();
+    history->idle = SDL_CreateCond();
+    if (history->lock && history->wake && history->idle)
+        history->worker = SDL_CreateThread(pack_worker, "undo", history);
+    if (history->worker == NULL)
+        warn("Failed to start undo thread %s, packing on this one",
+             SDL_GetError());
+}
+
+void history_free(history_t *history) {
+    if (history->worker != NULL) {
+        SDL_LockMutex(history->lock);
+        history->quit = true;
+        SDL_CondSignal(history->wake);
+        SDL_UnlockMutex(history->lock);
+        SDL_WaitThread(history->worker, NULL);
+    }
+    if (history->lock)
+        SDL_DestroyMutex(history->lock);
+    if (history->wake)
+        SDL_DestroyCond(history->wake);
+    if (history->idle)
+        SDL_DestroyCond(history->idle);
+    for (size_t i = 0; i < arrlen(history->entries); i++)
+        entry_free(&history->entries[i]);
+    arrfree(history->entries);
+    arrfree(history->queue);
+    entry_free(&history->cur);
+    journal_close(&history->journal);
+    free(history->saved);
+    free(history->unpacked);
+    history->entries = NULL;
+    history->queue = NULL;
+    history->saved = NULL;
+    history->unpacked = NULL;
+    history->worker = NULL;
+    history->layer->before_write = NULL;
+    history->layer->before_write_data = NULL;
+}
+
+void history_begin(history_t *history) {
+    if (history->open)
+        return;
+    /* tiles the worker has yet to pack are taken care of by save_tile,
+     * so a new stroke does not wait for the last fill to be packed.
+     * only when the copies waiting for it are past the budget */
+    if (history->bytes > history->budget)
+        settle(history);
+    else
+        settle_if_idle(history);
+    history->open = true;
+}
+
+void history_end(history_t *history) {
+    if (!history->open)
+        return;
+    history->open = false;
+    history_entry_t cur = history->cur;
+    history->cur = (history_entry_t){0};
+    for (size_t i = 0; i < arrlen(cur.tiles); i++)
+        history->saved[cur.tiles[i].tile] = 0;
+    if (arrlen(cur.tiles) == 0) {
+        entry_free(&cur);
+        return;
+    }
+
+    /* a new operation ends what could be redone */
+    for (size_t i = history->pos; i < arrlen(history->entries); i++) {
+        if (i >= history->spilled)
+            history->bytes -= history->entries[i].bytes;
+        entry_free(&history->entries[i]);
+    }
+    if (history->entries != NULL)
+        arrsetlen(history->entries, history->pos);
+    if (history->spilled > history->pos) {
+        history->spilled = history->pos;
+        journal_truncate(&history->journal, history->pos > 0
+                             ? history->entries[history->pos - 1].end
+                             : history->journal.start);
+    }
+    cur.bytes = entry_bytes(&cur);
+    arrpush(history->entries, cur);
+    history->bytes += cur.bytes;
+    history->pos++;
+    history->unsettled++;
+
+    if (history->worker == NULL) {
+        pack(history->layer, cur.tiles);
+        settle(history);
+        return;
+    }
+    SDL_LockMutex(history->lock);
+    for (size_t i = 0; i < arrlen(cur.tiles); i++)
+        history->unpacked[cur.tiles[i].tile] = &cur.tiles[i];
+    arrpush(history->queue, cur.tiles);
+    SDL_CondSignal(history->wake);
+    SDL_UnlockMutex(history->lock);
+}
+
+/* bring the entry's tiles to their state before (undo) or after it */
+static void entry_apply(history_t *history, history_entry_t *entry, bool undo) {
+    layer_t *layer = history->layer;
+    for (size_t i = 0; i < arrlen(entry->tiles); i++) {
+        const history_tile_t *t = &entry->tiles[i];
+        const int tx = t->tile % layer->tw, ty = t->tile / layer->tw;
+        if (undo ? t->before_clear : t->after_clear) {
+            argb *pixels = NULL;
+            layer_swap_tile(layer, tx, ty, &pixels);
+            free(pixels);
+        } else {
+            const uint32_t *delta = t->data ? t->data
+                                    : journal_at(&history->journal, t->offset);
+            /* no operation is open, the hook lets this through */
+            rle_xor(delta, t->size / sizeof(uint32_t),
+                    layer_tile_w(layer, tx, ty));
+        }
+    }
+}
+
+bool history_undo(history_t *history) {
+    if (history->open)
+        return false;
+    settle(history);
+    if (history->pos == 0)
+        return false;
+    entry_apply(history, &history->entries[--history->pos], true);
+    return true;
+}
+
+bool history_redo(history_t *history) {
+    if (history->open)
+        return false;
+    settle(history);
+    if (history->pos == arrlen(history->entries))
+        return false;
+    entry_apply(history, &history->entries[history->pos++], false);
+    return true;
+}
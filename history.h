@@ -0,0 +1,94 @@
+#pragma once
+
+#ifndef SDRAW_HISTORY_H
+#define SDRAW_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#include "journal.h"
+#include "layer.h"
+
+/* a tile an operation changed. until it is packed, data is a copy of
+ * its pixels before the operation. packed, data is the XOR of its
+ * pixels before and after, run length coded (see pack), which is all
+ * undo and redo need since XOR-ing it into either side gives the other.
+ * a clear side is a tile that was never written, it is freed again
+ * when stepping to that side. once spilled to the journal, data is NULL
+ * and the packed delta is at offset there */
+typedef struct {
+    int tile;
+    bool before_clear, after_clear;
+    uint32_t *data;
+    size_t size;
+    uint64_t offset;
+} history_tile_t;
+
+/* one operation, the tiles it changed (dynarray). end is where it ends
+ * in the journal once spilled */
+typedef struct {
+    history_tile_t *tiles;
+    size_t bytes;
+    uint64_t end;
+} history_entry_t;
+
+/* undo and redo for one layer. between history_begin and history_end
+ * every tile is copied right before the operation first writes it, so
+ * an entry costs only the tiles the operation touched. when it ends,
+ * the entry goes to a worker thread that packs it. undo and redo wait
+ * for that to finish first, the next operation does not: a tile it is
+ * about to write that is still waiting is packed right there. the
+ * worker reads the layer, so it must not be written outside an
+ * operation.
+ * past the memory budget, the oldest entries are moved to a journal
+ * file and read back from its mapping when they are undone. steps are
+ * only lost when the journal is full too, or there is none */
+typedef struct {
+    layer_t *layer;
+    /* dynarray, oldest first. entries[0..pos) can be undone, the rest
+     * redone. the first `spilled` are in the journal. the last
+     * `unsettled` were handed to the worker and have not been counted in
+     * bytes since */
+    history_entry_t *entries;
+    size_t pos, spilled, unsettled;
+    /* bytes held in memory by the entries, kept under budget */
+    size_t bytes, budget;
+    journal_t journal;
+    /* operation in progress, saved[i] is set once tile i is in it */
+    bool open;
+    history_entry_t cur;
+    uint8_t *saved;
+    /* packing worker, NULL if it could not be started and entries are
+     * packed by history_end. queue (dynarray) holds the tiles of entries
+     * not picked up yet, busy is set while one is being packed.
+     * unpacked[i] is the handed over tile with index i that nobody
+     * started packing yet, packing the index of the one the worker is
+     * on (-1 for none) */
+    SDL_Thread *worker;
+    SDL_mutex *lock;
+    SDL_cond *wake, *idle;
+    history_tile_t **queue;
+    history_tile_t **unpacked;
+    int packing;
+    bool busy, quit;
+} history_t;
+
+/* journal_cap is the most the journal may hold, 0 for no journal */
+void history_init(history_t *history, layer_t *layer, size_t budget,
+                  size_t journal_cap);
+void history_free(history_t *history);
+
+/* everything written to the layer between these is one operation. an
+ * operation that wrote nothing is not kept. history_begin while one is
+ * open does nothing, the writes go on into the open one */
+void history_begin(history_t *history);
+void history_end(history_t *history);
+
+/* false when there is nothing to undo (redo) or an operation is open */
+bool history_undo(history_t *history);
+bool history_redo(history_t *history);
+
+#endif
@@ -0,0 +1,145 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "journal.h"
+
+/* the file grows this much at a time */
+#define JOURNAL_CHUNK ((size_t)16 << 20)
+
+#ifdef _WIN32
+
+/* spilling is POSIX only, see journal.h */
+bool journal_open(journal_t *journal, size_t cap) {
+    (void)cap;
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    info("undo journal not supported on this platform");
+    return false;
+}
+
+void journal_close(journal_t *journal) {
+    (void)journal;
+}
+
+static bool journal_grow(journal_t *journal, size_t size) {
+    (void)journal;
+    (void)size;
+    return false;
+}
+
+#else
+
+bool journal_open(journal_t *journal, size_t cap) {
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    if (cap == 0)
+        return false;
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0')
+        dir = "/tmp";
+    size_t len = strlen(dir) + sizeof("/sdraw-undo-XXXXXX");
+    char *path = malloc(len);
+    if (path == NULL)
+        panic("Failed to allocate memory for undo journal");
+    snprintf(path, len, "%s/sdraw-undo-XXXXXX", dir);
+    journal->fd = mkstemp(path);
+    if (journal->fd < 0) {
+        warn("Failed to create undo journal in %s", dir);
+        free(path);
+        return false;
+    }
+    unlink(path);
+    free(path);
+    /* address space for all of it now, the file is grown under it */
+    void *map = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     journal->fd, 0);
+    if (map == MAP_FAILED) {
+        warn("Failed to map undo journal of %zu bytes", cap);
+        close(journal->fd);
+        journal->fd = -1;
+        return false;
+    }
+    journal->map = map;
+    journal->cap = cap;
+    return true;
+}
+
+void journal_close(journal_t *journal) {
+    if (journal->map != NULL)
+        munmap(journal->map, journal->cap);
+    if (journal->fd >= 0)
+        close(journal->fd);
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+}
+
+/* pages of the map past the end of the file can't be touched. the
+ * blocks are allocated here and not left sparse, so a full disk shows
+ * up now and not as SIGBUS when the map is written */
+static bool journal_grow(journal_t *journal, size_t size) {
+    if (size <= journal->size)
+        return true;
+    if (journal->failed)
+        return false;
+    size = (size + JOURNAL_CHUNK - 1) / JOURNAL_CHUNK * JOURNAL_CHUNK;
+    if (size > journal->cap)
+        size = journal->cap;
+    int err = posix_fallocate(journal->fd, journal->size, size - journal->size);
+    if (err != 0) {
+        warn("Failed to grow undo journal to %zu bytes: %s", size,
+             strerror(err));
+        journal->failed = true;
+        return false;
+    }
+    journal->size = size;
+    return true;
+}
+
+#endif
+
+bool journal_is_open(const journal_t *journal) {
+    return journal->map != NULL;
+}
+
+bool journal_reserve(journal_t *journal, size_t n) {
+    if (!journal_is_open(journal) || journal->end - journal->start + n > journal->cap)
+        return false;
+    if (journal->end - journal->base + n > journal->cap) {
+        /* compact, move what is live to the front */
+        memmove(journal->map, journal->map + (journal->start - journal->base),
+                journal->end - journal->start);
+        journal->base = journal->start;
+    }
+    return journal_grow(journal, journal->end - journal->base + n);
+}
+
+uint64_t journal_append(journal_t *journal, const void *data, size_t n) {
+    uint64_t offset = journal->end;
+    memcpy(journal->map + (offset - journal->base), data, n);
+    journal->end += n;
+    return offset;
+}
+
+void journal_truncate(journal_t *journal, uint64_t offset) {
+    if (offset < journal->end)
+        journal->end = offset < journal->start ? journal->start : offset;
+}
+
+void journal_release(journal_t *journal, uint64_t offset) {
+    if (offset > journal->start)
+        journal->start = offset;
+}
+
+const void *journal_at(const journal_t *journal, uint64_t offset) {
+    return journal->map + (offset - journal->base);
+}
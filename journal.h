@@ -0,0 +1,51 @@
+#pragma once
+
+#ifndef SDRAW_JOURNAL_H
+#define SDRAW_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* append-only temp file mapped into memory, for data that has to be
+ * kept but is rarely read. offsets only grow, what is released is at
+ * the front, so the live data is always [start, end). when the end
+ * reaches cap, the live data is moved back to the start of the file.
+ * the file is deleted as soon as it is made and goes away with the
+ * process even if journal_close is never called. POSIX only, on
+ * Windows journal_open always fails, undo keeps its steps in memory
+ * and drops the oldest past its budget */
+typedef struct {
+    int fd;
+    uint8_t *map;
+    size_t cap;
+    /* bytes of the file that exist, the rest of the map is not backed */
+    size_t size;
+    /* the file could not be grown, nothing more fits */
+    bool failed;
+    /* offset of map[0] */
+    uint64_t base;
+    uint64_t start, end;
+} journal_t;
+
+/* false, with a warning, if it can't be made. cap is the most it ever
+ * holds */
+bool journal_open(journal_t *journal, size_t cap);
+void journal_close(journal_t *journal);
+bool journal_is_open(const journal_t *journal);
+
+/* make room for n more bytes, false if they don't fit under cap even
+ * after everything before start is dropped, or if the disk is out of
+ * space (journal->failed is set then) */
+bool journal_reserve(journal_t *journal, size_t n);
+/* copy n bytes to the end, room must have been reserved. returns the
+ * offset they are at */
+uint64_t journal_append(journal_t *journal, const void *data, size_t n);
+/* everything from offset on is not needed any more, appends go there */
+void journal_truncate(journal_t *journal, uint64_t offset);
+/* everything before offset is not needed any more */
+void journal_release(journal_t *journal, uint64_t offset);
+
+const void *journal_at(const journal_t *journal, uint64_t offset);
+
+#endif
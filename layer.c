@@ -0,0 +1,190 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "dynarray.h"
+#include "layer.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void layer_extend(layer_t *layer, int x1, int y1, int x2, int y2) {
+    if (x1 > x2) {
+        /* reset to empty */
+        layer->extent.x1 = layer->extent.y1 = INT_MAX;
+        layer->extent.x2 = layer->extent.y2 = INT_MIN;
+        return;
+    }
+    layer->extent.x1 = MIN(layer->extent.x1, x1);
+    layer->extent.y1 = MIN(layer->extent.y1, y1);
+    layer->extent.x2 = MAX(layer->extent.x2, x2);
+    layer->extent.y2 = MAX(layer->extent.y2, y2);
+}
+
+void layer_init(layer_t *layer, int w, int h, argb clear) {
+    layer->w = w;
+    layer->h = h;
+    layer->tw = (w + TILE_MASK) >> TILE_SHIFT;
+    layer->th = (h + TILE_MASK) >> TILE_SHIFT;
+    layer->clear = clear;
+    layer->tiles = calloc((size_t)layer->tw * layer->th, sizeof(*layer->tiles));
+    layer->clear_tile = malloc(TILE_PIXELS * sizeof(argb));
+    layer->dirty = calloc((size_t)layer->tw * layer->th, sizeof(*layer->dirty));
+    if (layer->tiles == NULL || layer->clear_tile == NULL || layer->dirty == NULL)
+        panic("Failed to allocate memory for canvas, is canvas too big?");
+    for (int i = 0; i < TILE_PIXELS; i++)
+        layer->clear_tile[i] = clear;
+    layer->dirty_list = NULL;
+    layer->before_write = NULL;
+    layer->before_write_data = NULL;
+    layer->ntiles = 0;
+    layer_extend(layer, 0, 0, -1, -1);
+    /* whoever displays the layer has never seen any of it */
+    layer_mark_all_dirty(layer);
+}
+
+void layer_free(layer_t *layer) {
+    if (layer->tiles != NULL)
+        for (int i = 0; i < layer->tw * layer->th; i++)
+            free(layer->tiles[i]);
+    free(layer->tiles);
+    free(layer->clear_tile);
+    free(layer->dirty);
+    arrfree(layer->dirty_list);
+    layer->tiles = NULL;
+    layer->clear_tile = NULL;
+    layer->dirty = NULL;
+    layer->dirty_list = NULL;
+}
+
+const argb *layer_tile(const layer_t *layer, int tx, int ty) {
+    const argb *tile = layer->tiles[ty * layer->tw + tx];
+    return tile ? tile : layer->clear_tile;
+}
+
+static argb *tile_w(layer_t *layer, int tx, int ty) {
+    argb **tile = &layer->tiles[ty * layer->tw + tx];
+    if (layer->before_write)
+        layer->before_write(layer->before_write_data, layer, ty * layer->tw + tx);
+    layer_mark_dirty(layer, tx, ty);
+    if (*tile == NULL) {
+        *tile = malloc(TILE_PIXELS * sizeof(argb));
+        if (*tile == NULL)
+            panic("Failed to allocate canvas tile");
+        memcpy(*tile, layer->clear_tile, TILE_PIXELS * sizeof(argb));
+        layer->ntiles++;
+    }
+    return *tile;
+}
+
+argb *layer_tile_w(layer_t *layer, int tx, int ty) {
+    layer_extend(layer, tx * TILE_SIZE, ty * TILE_SIZE,
+                 MIN(layer->w, (tx + 1) * TILE_SIZE) - 1,
+                 MIN(layer->h, (ty + 1) * TILE_SIZE) - 1);
+    return tile_w(layer, tx, ty);
+}
+
+void layer_swap_tile(layer_t *layer, int tx, int ty, argb **pixels) {
+    argb **tile = &layer->tiles[ty * layer->tw + tx];
+    argb *old = *tile;
+    layer->ntiles += (*pixels != NULL) - (old != NULL);
+    *tile = *pixels;
+    *pixels = old;
+    layer_extend(layer, tx * TILE_SIZE, ty * TILE_SIZE,
+                 MIN(layer->w, (tx + 1) * TILE_SIZE) - 1,
+                 MIN(layer->h, (ty + 1) * TILE_SIZE) - 1);
+    layer_mark_dirty(layer, tx, ty);
+}
+
+argb layer_get(const layer_t *layer, int x, int y) {
+    return layer_tile(layer, x >> TILE_SHIFT, y >> TILE_SHIFT)
+        [(y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK)];
+}
+
+static int span_len(const layer_t *layer, int x) {
+    int n = TILE_SIZE - (x & TILE_MASK);
+    return x + n > layer->w ? layer->w - x : n;
+}
+
+const argb *layer_span(const layer_t *layer, int x, int y, int *n) {
+    *n = span_len(layer, x);
+    return layer_tile(layer, x >> TILE_SHIFT, y >> TILE_SHIFT) +
+           (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+}
+
+argb *layer_span_w(layer_t *layer, int x, int y, int *n) {
+    *n = span_len(layer, x);
+    layer_extend(layer, x, y, x + *n - 1, y);
+    return tile_w(layer, x >> TILE_SHIFT, y >> TILE_SHIFT) +
+           (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+}
+
+void layer_read_row(const layer_t *layer, int x, int y, int n, argb *out) {
+    while (n > 0) {
+        int len;
+        const argb *src = layer_span(layer, x, y, &len);
+        len = len < n ? len : n;
+        memcpy(out, src, len * sizeof(argb));
+        out += len;
+        x += len;
+        n -= len;
+    }
+}
+
+void layer_write_row(layer_t *layer, int x, int y, int n, const argb *in) {
+    while (n > 0) {
+        int len;
+        argb *dst = layer_span_w(layer, x, y, &len);
+        len = len < n ? len : n;
+        memcpy(dst, in, len * sizeof(argb));
+        in += len;
+        x += len;
+        n -= len;
+    }
+}
+
+void layer_clear_extent(layer_t *layer) {
+    if (layer_extent_empty(layer))
+        return;
+    int x1 = layer->extent.x1, x2 = layer->extent.x2;
+    for (int y = layer->extent.y1; y <= layer->extent.y2; y++) {
+        for (int x = x1; x <= x2;) {
+            int n = MIN(span_len(layer, x), x2 - x + 1);
+            /* untouched tiles are already clear */
+            if (layer->tiles[(y >> TILE_SHIFT) * layer->tw + (x >> TILE_SHIFT)]) {
+                argb *px = tile_w(layer, x >> TILE_SHIFT, y >> TILE_SHIFT) +
+                           (y & TILE_MASK) * TILE_SIZE + (x & TILE_MASK);
+                for (int i = 0; i < n; i++)
+                    px[i] = layer->clear;
+            }
+            x += n;
+        }
+    }
+    layer_extend(layer, 0, 0, -1, -1);
+}
+
+bool layer_extent_empty(const layer_t *layer) {
+    return layer->extent.x1 > layer->extent.x2;
+}
+
+void layer_mark_dirty(layer_t *layer, int tx, int ty) {
+    int i = ty * layer->tw + tx;
+    if (layer->dirty[i])
+        return;
+    layer->dirty[i] = 1;
+    arrpush(layer->dirty_list, i);
+}
+
+void layer_mark_all_dirty(layer_t *layer) {
+    for (int ty = 0; ty < layer->th; ty++)
+        for (int tx = 0; tx < layer->tw; tx++)
+            layer_mark_dirty(layer, tx, ty);
+}
+
+void layer_clear_dirty(layer_t *layer) {
+    for (size_t i = 0; i < arrlen(layer->dirty_list); i++)
+        layer->dirty[layer->dirty_list[i]] = 0;
+    if (layer->dirty_list != NULL)
+        arrsetlen(layer->dirty_list, 0);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#ifndef SDRAW_LAYER_H
+#define SDRAW_LAYER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t argb;
+
+typedef struct layer layer_t;
+
+/* canvas pixels are stored in square tiles of TILE_SIZE * TILE_SIZE,
+ * each tile is one contiguous block, row by row, so a tile row is a span
+ * that can be handed to memset/memcpy-like loops directly */
+#define TILE_SHIFT 6
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
+
+struct layer {
+    /* tw * th tiles, row-major. tile that was never written is NULL
+     * and reads as `clear` */
+    argb **tiles;
+    /* one tile full of `clear`, returned for reads of NULL tiles */
+    argb *clear_tile;
+    argb clear;
+    int w, h;
+    int tw, th;
+    /* number of non-NULL tiles, 0 means the whole layer is `clear` */
+    int ntiles;
+    /* bounding box (inclusive) of every pixel handed out for writing
+     * since the last layer_clear_extent, empty when x1 > x2 */
+    struct {
+        int x1, y1, x2, y2;
+    } extent;
+    /* tiles written since the renderer last uploaded them. dirty[i] is
+     * set once the tile index i is in dirty_list (dynarray) */
+    uint8_t *dirty;
+    int *dirty_list;
+    /* when set, called with a tile's index right before the tile is
+     * first handed out for writing. it still holds the old pixels, or is
+     * NULL if never written */
+    void (*before_write)(void *data, layer_t *layer, int tile);
+    void *before_write_data;
+};
+
+void layer_init(layer_t *layer, int w, int h, argb clear);
+void layer_free(layer_t *layer);
+
+/* tile at tile coordinate tx, ty. layer_tile returns clear_tile for
+ * untouched tiles, layer_tile_w allocates it and marks it dirty */
+const argb *layer_tile(const layer_t *layer, int tx, int ty);
+argb *layer_tile_w(layer_t *layer, int tx, int ty);
+
+/* exchange tile tx, ty with *pixels (NULL for a clear tile), without
+ * calling before_write. the tile is marked dirty */
+void layer_swap_tile(layer_t *layer, int tx, int ty, argb **pixels);
+
+/* pixel read, x and y must be inside the layer */
+argb layer_get(const layer_t *layer, int x, int y);
+
+/* pointer to pixel x, y and in *n how many pixels the span continues
+ * to the right before it leaves the tile (or the layer) */
+const argb *layer_span(const layer_t *layer, int x, int y, int *n);
+argb *layer_span_w(layer_t *layer, int x, int y, int *n);
+
+/* copy n pixels of row y starting at x, from / to a flat buffer */
+void layer_read_row(const layer_t *layer, int x, int y, int n, argb *out);
+void layer_write_row(layer_t *layer, int x, int y, int n, const argb *in);
+
+/* set only the pixels inside extent back to `clear`, so the cost follows
+ * the size of what was drawn instead of the size of the layer */
+void layer_clear_extent(layer_t *layer);
+bool layer_extent_empty(const layer_t *layer);
+
+void layer_mark_dirty(layer_t *layer, int tx, int ty);
+void layer_mark_all_dirty(layer_t *layer);
+/* forget dirty tiles, call after they have been consumed */
+void layer_clear_dirty(layer_t *layer);
+
+#endif
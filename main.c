@@ -4,13 +4,15 @@
  *   done - rectangle tool
  *   - select & mvoe tool
  *   - lasso select tool
- *   - undo & redo
+ *   done - undo & redo
  *   - png export
  *   done - text tool
  *
  *  sleepntsheep 2022
  */
 
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -18,7 +20,6 @@
 #include <stdlib.h>
 
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_ttf.h>
 
 #include "tinyfiledialogs.h"
 #define STBI_ONLY_JPEG
@@ -36,7 +37,14 @@
 #include "stb_ds.h"*/
 
 #include "config.h"
+#include "blend.h"
+#include "cmdlog.h"
+#include "fill.h"
 #include "font.h"
+#include "glyph.h"
+#include "history.h"
+#include "layer.h"
+#include "mip.h"
 
 
 #define NK_BUTTON_TRIGGER_ON_RELEASE
@@ -54,17 +62,43 @@
 #include "nuklear.h"
 #include "nuklear_sdl_renderer.h"
 
-//#define STB_TRUETYPE_IMPLEMENTATION 
-//#include "stb_truetype.h"
+/* nuklear's font baking brings the stb_truetype implementation, the
+ * text tool (glyph.c) uses it too */
 
 #define UNUSED(a) ((void)(a))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
-typedef uint32_t argb;
-
 const int GUI_HEIGHT = 150;
 const int MAX_BRUSHSIZE = 30;
+/* frames are paced to this rate from their measured duration, or by the
+ * display when USE_VSYNC is set */
+const int TARGET_FPS = 60;
+const bool USE_VSYNC = false;
+/* frames averaged per line of --bench output */
+const int BENCH_FRAMES = 120;
+/* view zoom per mouse wheel step, and its range */
+const double ZOOM_STEP = 1.25;
+const double MIN_ZOOM = 1.0 / 64;
+const double MAX_ZOOM = 64;
+/* changed rects of the view rendered one by one, past that many in a
+ * frame their bounding box is rendered as one */
+const int MAX_UPDATE_RECTS = 32;
+/* memory kept for undo, past it the oldest steps are moved to a journal
+ * file of at most UNDO_JOURNAL_CAP bytes (0 for none), past that they
+ * are dropped. the journal is POSIX only, on Windows steps stay in
+ * memory until the budget and are dropped past it */
+const size_t UNDO_BUDGET = (size_t)256 << 20;
+#if SIZE_MAX > 0xFFFFFFFFu
+const size_t UNDO_JOURNAL_CAP = (size_t)4 << 30;
+#else
+/* the map has to fit in what is left of a 32 bit address space */
+const size_t UNDO_JOURNAL_CAP = (size_t)512 << 20;
+#endif
+/* with --undo-log, operations between two snapshots of the canvas */
+const int UNDO_KEYFRAME_INTERVAL = 32;
+/* font files and handles kept open for the text tool */
+const size_t FONT_CACHE_BUDGET = (size_t)64 << 20;
 
 enum Tool {
     BRUSH,
@@ -77,15 +111,61 @@ enum Tool {
 };
 
 typedef struct {
-    argb *fb;
-    argb *tfb;
+    int x, y;
+} vec2i_t;
+
+/* pixels x1..x2 (inclusive) of row y */
+typedef struct {
+    int y, x1, x2;
+} span_t;
+
+typedef struct {
+    layer_t fb;
+    layer_t tfb;
     argb fg;
     int w, h;
     int tool;
     int brushsize;
+    /* bucket: per channel tolerance, and whether it replaces every
+     * matching pixel instead of only the connected region */
+    int fill_tolerance;
+    bool fill_global;
     bool isdrag;
     int lx, ly;
+    /* brush points (dynarray) received since the last flush, the stroke
+     * continues from lx, ly through them */
+    vec2i_t *stroke;
     bool use_tfb;
+    /* undo and redo of fb, by tiles in history or, with undo_log, by
+     * drawing the operations again from cmdlog. op is the operation
+     * being drawn, recorded for cmdlog */
+    bool undo_log;
+    history_t history;
+    cmdlog_t cmdlog;
+    cmdlog_op_t op;
+    /* the text tool's text while it is being placed, shown on tfb until
+     * it is drawn. line is kept from frame to frame, so typing lays out
+     * and renders only what changed and moving only blits line.run */
+    struct canvas_text {
+        /* top left of the line, and where in it the drag started */
+        int x, y;
+        bool dragging;
+        int grab_x, grab_y;
+        /* the font line is laid out in, bad when it can't be loaded */
+        char *font;
+        int size;
+        bool bad;
+        glyph_line_t line;
+        /* whether it is on tfb, and where and in which colour */
+        bool shown;
+        int shown_x, shown_y;
+        argb shown_fg;
+    } text;
+    /* the part of the canvas the window shows: canvas point x, y is at
+     * window point (x - view.x) * view.zoom, (y - view.y) * view.zoom */
+    struct {
+        double x, y, zoom;
+    } view;
 } canvas_t;
 
 typedef struct {
@@ -112,19 +192,55 @@ typedef struct {
         char size_buf[1024];
         int selidx;
         int size;
-        int x, y;
     } text;
 } gui_t;
 
+/* chosen on the command line, kept when the app is re-created */
+typedef struct {
+    /* composite into the window surface and draw the gui with a software
+     * renderer on it, instead of going through a texture */
+    bool surface;
+    /* log frame times */
+    bool bench;
+    /* undo by operations and keyframes instead of tiles */
+    bool undo_log;
+} app_opts_t;
+
 typedef struct {
     canvas_t canvas;
+    app_opts_t opts;
     SDL_Window *win;
     SDL_Renderer *rend;
+    /* the view, app->w * app->h of canvas.tfb composited over canvas.fb,
+     * in the renderer's native format. ARGB or, with tex_swap_rb, ABGR
+     * byte order */
     SDL_Texture *tex;
+    bool tex_swap_rb;
+    /* reductions of the composited canvas, for zoomed out views */
+    mip_t mip;
+    /* the view changed, so all of it is drawn again next frame */
+    bool view_moved;
+    bool panning;
+    /* with opts.surface, the window surface. as dynarrays, the rects of
+     * the window to update this frame and the gui windows drawn last
+     * frame */
+    SDL_Surface *surface;
+    SDL_Rect *update_rects;
+    SDL_Rect *gui_rects;
+    struct {
+        Uint64 canvas, gui, present;
+        int frames;
+    } bench;
     bool running;
+    /* frames still to draw. input sets it to 2, nuklear shows changes
+     * made while handling the first frame's input only on the second */
+    int redraw;
     int w, h;
     gui_t gui;
-    sdraw_font_t *font_arr;
+    /* the font list once it is found (see app_fonts), and its names for
+     * the combobox (dynarray) */
+    bool fonts_ready;
+    const sdraw_font_t *font_arr;
     const char **font_name_arr;
     struct {
         argb *data;
@@ -132,85 +248,240 @@ typedef struct {
     } select;
 } app_t;
 
-typedef struct {
-    int x, y;
-} vec2i_t;
+void canvas_replay(void *data, const cmdlog_op_t *op);
 
-void canvas_init(canvas_t *canvas, int w, int h) {
-    canvas->fb = malloc(sizeof(*canvas->fb) * w * h);
-    if (canvas->fb == NULL)
-        panic("Failed to allocate memory for canvas, is canvas too big?");
-    canvas->tfb = calloc(sizeof(*canvas->tfb), w * h);
-    if (canvas->tfb == NULL)
-        panic("Failed to allocate memory for canvas, is canvas too big?");
-    memset(canvas->fb, 0xFF, sizeof(*canvas->fb) * w * h);
-    memset(canvas->tfb, 0x00, sizeof(*canvas->tfb) * w * h);
+void canvas_init(canvas_t *canvas, int w, int h, bool undo_log) {
+    /* tiles are allocated on first write, so a fresh canvas costs
+     * only the tile tables */
+    layer_init(&canvas->fb, w, h, 0xFFFFFFFF);
+    layer_init(&canvas->tfb, w, h, 0x00000000);
+    canvas->use_tfb = false;
     canvas->isdrag = false;
     canvas->brushsize = 1;
+    canvas->fill_tolerance = 0;
+    canvas->fill_global = false;
     canvas->tool = BRUSH;
     canvas->fg = colors[0];
     canvas->lx = canvas->ly = 0;
+    canvas->stroke = NULL;
+    canvas->view.x = canvas->view.y = 0;
+    canvas->view.zoom = 1;
     canvas->w = w;
     canvas->h = h;
+    canvas->undo_log = undo_log;
+    memset(&canvas->op, 0, sizeof(canvas->op));
+    memset(&canvas->text, 0, sizeof(canvas->text));
+    if (undo_log)
+        cmdlog_init(&canvas->cmdlog, &canvas->fb, UNDO_KEYFRAME_INTERVAL,
+                    canvas_replay, canvas);
+    else
+        history_init(&canvas->history, &canvas->fb, UNDO_BUDGET,
+                     UNDO_JOURNAL_CAP);
 }
 
-#define ALPHA(argb) (argb & 0xFF000000)
-#define RED(argb) (argb & 0x00FF0000)
-#define GREEN(argb) (argb & 0x0000FF00)
-#define BLUE(argb) (argb & 0x000000FF)
+#define ALPHA(argb) (((argb) >> 24) & 0xFF)
+#define RED(argb) (((argb) >> 16) & 0xFF)
+#define GREEN(argb) (((argb) >> 8) & 0xFF)
+#define BLUE(argb) ((argb) & 0xFF)
 
-argb canvas_get_pixel(canvas_t *canvas, int x, int y) {
-    if (canvas->use_tfb)
-        return canvas->tfb[y * canvas->w + x];
-    else
-        return canvas->fb[y * canvas->w + x];
+/* canvas pixel under the centre of window pixel wx, wy */
+int canvas_view_x(const canvas_t *canvas, int wx) {
+    return (int)floor(canvas->view.x + (wx + 0.5) / canvas->view.zoom);
+}
+
+int canvas_view_y(const canvas_t *canvas, int wy) {
+    return (int)floor(canvas->view.y + (wy + 0.5) / canvas->view.zoom);
+}
+
+layer_t *canvas_layer(canvas_t *canvas) {
+    return canvas->use_tfb ? &canvas->tfb : &canvas->fb;
 }
 
-void canvas_set_pixel(canvas_t *canvas, int x, int y) {
-    if (x < 0 || y < 0 || x >= canvas->w || y >= canvas->h)
+/* whether fg has to be blended, or can just be stored. the preview
+ * always stores fg as is, it gets blended when its texture is drawn */
+bool canvas_is_blending(canvas_t *canvas) {
+    return !canvas->use_tfb && ALPHA(canvas->fg) != 255;
+}
+
+/* paint pixels x1..x2 (inclusive) of row y, clipped once for the whole
+ * span instead of once per pixel, walking the span tile by tile */
+void canvas_draw_span(canvas_t *canvas, int x1, int x2, int y) {
+    if (y < 0 || y >= canvas->h)
         return;
-    uint8_t r, g, b;
-    argb bg = canvas_get_pixel(canvas, x, y), fg;
-    if (ALPHA(canvas->fg) != 255) {
-        // alpha
-        r = RED(canvas->fg) * ALPHA(canvas->fg) + (bg * (255 - ALPHA(canvas->fg)));
-        g = GREEN(canvas->fg) * ALPHA(canvas->fg) + (bg * (255 - ALPHA(canvas->fg)));
-        b = BLUE(canvas->fg) * ALPHA(canvas->fg) + (bg * (255 - ALPHA(canvas->fg)));
-        fg = 0x0 | (r << 4) | (g << 2) | b;
-    } else {
-        fg = canvas->fg;
-    }
-    if (canvas->use_tfb)
-        canvas->tfb[y * canvas->w + x] = fg;
-    else
-        canvas->fb[y * canvas->w + x] = fg;
+    x1 = MAX(x1, 0);
+    x2 = MIN(x2, canvas->w - 1);
+    layer_t *layer = canvas_layer(canvas);
+    bool blending = canvas_is_blending(canvas);
+    while (x1 <= x2) {
+        int n;
+        argb *px = layer_span_w(layer, x1, y, &n);
+        n = MIN(n, x2 - x1 + 1);
+        if (blending)
+            blend_span(px, canvas->fg, n);
+        else
+            set_span(px, canvas->fg, n);
+        x1 += n;
+    }
+}
+
+/* paint the rectangle x1..x2, y1..y2 (inclusive, any corner order).
+ * goes tile by tile and row by row inside a tile, so every span is one
+ * contiguous run of memory and the tile stays in cache until it is done */
+void canvas_fill_rect(canvas_t *canvas, int x1, int y1, int x2, int y2) {
+    int sx = MAX(MIN(x1, x2), 0);
+    int ex = MIN(MAX(x1, x2), canvas->w - 1);
+    int sy = MAX(MIN(y1, y2), 0);
+    int ey = MIN(MAX(y1, y2), canvas->h - 1);
+    layer_t *layer = canvas_layer(canvas);
+    bool blending = canvas_is_blending(canvas);
+    for (int ty = sy; ty <= ey; ty = (ty | TILE_MASK) + 1) {
+        int tey = MIN(ty | TILE_MASK, ey);
+        for (int tx = sx; tx <= ex; tx = (tx | TILE_MASK) + 1) {
+            int n = MIN(tx | TILE_MASK, ex) - tx + 1;
+            for (int y = ty; y <= tey; y++) {
+                int left;
+                argb *px = layer_span_w(layer, tx, y, &left);
+                if (blending)
+                    blend_span(px, canvas->fg, n);
+                else
+                    set_span(px, canvas->fg, n);
+            }
+        }
+    }
+}
+
+/* outline of the rectangle with corners x1, y1 and x2, y2, covering what
+ * the brush sweeps along its four edges. drawn as a top and bottom band
+ * and the two sides between them, so no pixel is painted twice */
+void canvas_draw_rect(canvas_t *canvas, int x1, int y1, int x2, int y2) {
+    const int bs = canvas->brushsize;
+    int sx = MIN(x1, x2) - bs, ex = MAX(x1, x2) + bs - 1;
+    int sy = MIN(y1, y2) - bs, ey = MAX(y1, y2) + bs - 1;
+    /* bands too thick for a hole in the middle */
+    if (ey - sy + 1 <= 4 * bs || ex - sx + 1 <= 4 * bs) {
+        canvas_fill_rect(canvas, sx, sy, ex, ey);
+        return;
+    }
+    canvas_fill_rect(canvas, sx, sy, ex, sy + 2 * bs - 1);
+    canvas_fill_rect(canvas, sx, ey - 2 * bs + 1, ex, ey);
+    canvas_fill_rect(canvas, sx, sy + 2 * bs, sx + 2 * bs - 1, ey - 2 * bs);
+    canvas_fill_rect(canvas, ex - 2 * bs + 1, sy + 2 * bs, ex, ey - 2 * bs);
+}
+
+void app_view_set(app_t *app, double x, double y, double zoom) {
+    canvas_t *canvas = &app->canvas;
+    zoom = MIN(MAX(zoom, MIN_ZOOM), MAX_ZOOM);
+    /* keep some of the canvas in the view */
+    const double vw = app->w / zoom, vh = app->h / zoom;
+    canvas->view.x = MIN(MAX(x, -vw / 2), canvas->w - vw / 2);
+    canvas->view.y = MIN(MAX(y, -vh / 2), canvas->h - vh / 2);
+    canvas->view.zoom = zoom;
+    app->view_moved = true;
+}
+
+/* whole canvas in the view, never zoomed in */
+void app_view_fit(app_t *app) {
+    double zoom = MIN((double)app->w / app->canvas.w,
+                      (double)app->h / app->canvas.h);
+    app_view_set(app, 0, 0, MIN(zoom, 1));
+}
+
+/* zoom so that the canvas point under window point wx, wy stays there */
+void app_view_zoom(app_t *app, double zoom, int wx, int wy) {
+    const canvas_t *canvas = &app->canvas;
+    zoom = MIN(MAX(zoom, MIN_ZOOM), MAX_ZOOM);
+    double cx = canvas->view.x + wx / canvas->view.zoom;
+    double cy = canvas->view.y + wy / canvas->view.zoom;
+    app_view_set(app, cx - wx / zoom, cy - wy / zoom, zoom);
+}
+
+/* first 32 bit format in the renderer's list (native one first) that
+ * the compositor can write, so SDL never has to convert the texture */
+Uint32 app_texture_format(app_t *app) {
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(app->rend, &info) == 0) {
+        for (Uint32 i = 0; i < info.num_texture_formats; i++) {
+            switch (info.texture_formats[i]) {
+                case SDL_PIXELFORMAT_ARGB8888:
+                case SDL_PIXELFORMAT_RGB888:
+                    app->tex_swap_rb = false;
+                    return info.texture_formats[i];
+                case SDL_PIXELFORMAT_ABGR8888:
+                case SDL_PIXELFORMAT_BGR888:
+                    app->tex_swap_rb = true;
+                    return info.texture_formats[i];
+            }
+        }
+    }
+    app->tex_swap_rb = false;
+    return SDL_PIXELFORMAT_ARGB8888;
 }
 
-void app_init(app_t *app, int w, int h) {
+/* the window surface when its pixels are 32 bit ARGB or ABGR, the only
+ * layouts the compositor writes */
+SDL_Surface *app_window_surface(app_t *app) {
+    SDL_Surface *surface = SDL_GetWindowSurface(app->win);
+    if (surface == NULL) {
+        warn("SDL_GetWindowSurface Failed %s", SDL_GetError());
+        return NULL;
+    }
+    switch (surface->format->format) {
+        case SDL_PIXELFORMAT_ARGB8888:
+        case SDL_PIXELFORMAT_RGB888:
+            app->tex_swap_rb = false;
+            return surface;
+        case SDL_PIXELFORMAT_ABGR8888:
+        case SDL_PIXELFORMAT_BGR888:
+            app->tex_swap_rb = true;
+            return surface;
+    }
+    warn("window surface format %s not supported",
+         SDL_GetPixelFormatName(surface->format->format));
+    return NULL;
+}
+
+void app_init(app_t *app, int w, int h, app_opts_t opts) {
     /* w, h params are canvas size, app->w and app->h is different */
     memset(app, 0, sizeof(app_t));
-    app->font_arr = get_all_fonts();
-    qsort(app->font_arr, dynarray_len(app->font_arr), sizeof(sdraw_font_t),
-          sdraw_font_cmp);
-    app->font_name_arr = NULL;
-    for (size_t i = 0; i < dynarray_len(app->font_arr); i++) {
-        arrpush(app->font_name_arr, app->font_arr[i].name);
-        assert(app->font_arr[i].name == app->font_name_arr[i]);
-    }
+    app->opts = opts;
+    /* the window is at most the screen, bigger canvases are zoomed out
+     * or panned around in it */
+    SDL_Rect usable;
     app->w = MAX(w, 500);
     app->h = h;
+    if (SDL_GetDisplayUsableBounds(0, &usable) == 0) {
+        app->w = MIN(app->w, usable.w);
+        app->h = MIN(app->h, usable.h - GUI_HEIGHT);
+    }
     app->win = SDL_CreateWindow("sdraw", SDL_WINDOWPOS_CENTERED,
-                                SDL_WINDOWPOS_CENTERED, app->w, h + GUI_HEIGHT,
+                                SDL_WINDOWPOS_CENTERED, app->w, app->h + GUI_HEIGHT,
                                 SDL_WINDOW_SHOWN);
-    app->rend = SDL_CreateRenderer(app->win, -1, 0);
-    app->tex = SDL_CreateTexture(app->rend, SDL_PIXELFORMAT_ARGB8888,
-                                 SDL_TEXTUREACCESS_STREAMING, w, h);
-    SDL_SetTextureBlendMode(app->tex, SDL_BLENDMODE_BLEND);
+    if (app->opts.surface) {
+        app->surface = app_window_surface(app);
+        if (app->surface) {
+            app->rend = SDL_CreateSoftwareRenderer(app->surface);
+        } else {
+            warn("falling back to the renderer");
+            app->opts.surface = false;
+        }
+    }
+    if (!app->opts.surface) {
+        app->rend = SDL_CreateRenderer(app->win, -1,
+                                       USE_VSYNC ? SDL_RENDERER_PRESENTVSYNC : 0);
+        app->tex = SDL_CreateTexture(app->rend, app_texture_format(app),
+                                     SDL_TEXTUREACCESS_STREAMING, app->w,
+                                     app->h);
+        SDL_SetTextureBlendMode(app->tex, SDL_BLENDMODE_BLEND);
+    }
     app->running = true;
-    canvas_init(&app->canvas, w, h);
+    app->redraw = 2;
+    canvas_init(&app->canvas, w, h, opts.undo_log);
+    mip_init(&app->mip, &app->canvas.fb, &app->canvas.tfb);
+    app_view_fit(app);
     app->gui.ctx = nk_sdl_init(app->win, app->rend);
     app->gui.save.quality = 100;
     app->gui.text.selidx = 0;
+    app->gui.text.size = 32;
     {
         const float font_scale = 1;
         struct nk_font_atlas *atlas;
@@ -225,165 +496,184 @@ void app_init(app_t *app, int w, int h) {
 }
 
 
-void canvas_draw_text(canvas_t *canvas, int x, int y, const char *text,
-        const char *font_path, int font_size) {
-    
-    /* DONT KNOW HOW TO DRAW UTF-8 IN STB_TRUETYPE, SO FOR NOW IM USING SDL2_TTF */
-    /*
-    FILE* fontFile = fopen(font_path, "rb");
-    fseek(fontFile, 0, SEEK_END);
-    size_t size = ftell(fontFile);
-    fseek(fontFile, 0, SEEK_SET);
-    uint8_t *fontBuffer = malloc(size);
-    fread(fontBuffer, size, 1, fontFile);
-    fclose(fontFile);
-    stbtt_fontinfo info;
-    if (!stbtt_InitFont(&info, fontBuffer, stbtt_GetFontOffsetForIndex(fontBuffer, 0))) {
-        warn("Failed loading font");
-        return;
-    }
-    free(fontBuffer);
-
-    float scale = stbtt_ScaleForPixelHeight(&info, font_size);
-
-    int ascent, descent, lineGap;
-    stbtt_GetFontVMetrics(&info, &ascent, &descent, &lineGap);
-
-    ascent *= scale;
-    descent *= scale;
-
-    size_t utf8_len = strlen(text);
-    nk_uint *wtext = calloc(sizeof *wtext, utf8_len + 1);
-    size_t utf16_len = nk_utf_decode(text, wtext, utf8_len);
-
-    for (size_t i = 0; wtext[i]; i++)
-    {
-        int c_x1, c_y1, c_x2, c_y2;
-        stbtt_GetCodepointBitmapBox(&info, wtext[i], scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
-
-        int chy = y + ascent + c_y1;
-
-        int width = c_x2 - c_x1, height = c_y2 - c_y1;
-        unsigned char *bitmap = stbtt_GetCodepointBitmap(&info, scale, scale, wtext[i], &width, &height, NULL, NULL);
-
-        int ax = 0, left_side_bearing;
-        stbtt_GetCodepointHMetrics(&info, wtext[i], &ax, &left_side_bearing);
-        x += (ax + left_side_bearing) * scale;
-
-        if (wtext[i+1])
-            x += scale * stbtt_GetCodepointKernAdvance(&info, wtext[i], wtext[i+1]);
-
-        for (int i = 0; i < width; i++)
-            for (int j = 0; j < height; j++)
-                if (bitmap[j*width + i] != 0)
-                    canvas_set_pixel(canvas, i+x, j+chy);
+static char *str_copy(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    if (copy == NULL)
+        panic("Failed to allocate memory");
+    return memcpy(copy, str, len);
+}
 
-        free(bitmap);
+/* blend a w * h coverage mask (rows stride bytes apart) in fg, with its
+ * top left at x, y. rows are clipped once and go through mask_span a tile
+ * span at a time, tiles where the mask is all 0 are not written */
+void canvas_draw_mask(canvas_t *canvas, int x, int y, const uint8_t *mask,
+                      int stride, int w, int h) {
+    const int x1 = MAX(x, 0), x2 = MIN(x + w, canvas->w);
+    layer_t *layer = canvas_layer(canvas);
+    const bool blend = !canvas->use_tfb;
+    for (int j = MAX(-y, 0); j < h && y + j < canvas->h && x1 < x2; j++) {
+        const uint8_t *row = mask + (size_t)j * stride;
+        for (int i = x1; i < x2;) {
+            int n, left;
+            layer_span(layer, i, y + j, &n);
+            n = MIN(n, x2 - i);
+            int k = 0;
+            while (k < n && row[i - x + k] == 0)
+                k++;
+            if (k < n)
+                mask_span(layer_span_w(layer, i, y + j, &left), canvas->fg,
+                          row + (i - x), n, blend);
+            i += n;
+        }
     }
-    */
+}
 
-    /* TODOOOOOOOOOO: let user move text around, before deciding on final position */
-    TTF_Font *font;
-    SDL_Surface *surf;
-    font = TTF_OpenFont(font_path, font_size);
-    if (font == NULL) {
+/* x, y is the top left of the line */
+void canvas_draw_text(canvas_t *canvas, int x, int y, const char *text,
+        const char *font_path, int font_size) {
+    /* the cache's, not freed here */
+    glyph_face_t *face = font_cache_get(font_path, font_size);
+    if (face == NULL) {
         warn("Failed to load font: %s", font_path);
         return;
     }
-    surf = TTF_RenderUTF8_Blended(font, text, (SDL_Color){0, 0, 0, 255});
-    if (surf == NULL) {
-        warn("Failed to render text");
-        return;
-    }
-    // texture from surf
-    SDL_Renderer *rend = SDL_CreateSoftwareRenderer(surf);
-    SDL_SetRenderDrawBlendMode(rend, SDL_BLENDMODE_BLEND);
-    SDL_Texture *tex = SDL_CreateTextureFromSurface(rend, surf);
-    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
-    if (tex == NULL) {
-        warn("Failed to create texture from surface");
-        return;
-    }
-    if (rend == NULL) {
-        warn("Failed to create software renderer");
+    glyph_line_t line = {0};
+    glyph_line_set(face, &line, text);
+    const glyph_run_t *run = &line.run;
+    if (run->mask != NULL)
+        canvas_draw_mask(canvas, x + run->x, y + run->y, run->mask,
+                         run->stride, run->w, run->h);
+    glyph_line_free(&line);
+}
+
+/* take the text preview off tfb */
+void canvas_text_hide(canvas_t *canvas) {
+    if (canvas->text.shown)
+        layer_clear_extent(&canvas->tfb);
+    canvas->text.shown = false;
+    canvas->text.dragging = false;
+}
+
+/* show text in font_path at size on tfb, where the text tool has it.
+ * called every frame the text tool is open, so it only lays out what
+ * changed, and only blits when anything did */
+void canvas_text_show(canvas_t *canvas, const char *text,
+                      const char *font_path, int size) {
+    struct canvas_text *t = &canvas->text;
+    const bool same_font = t->font != NULL && strcmp(t->font, font_path) == 0 &&
+                           t->size == size;
+    if (same_font && t->bad)
         return;
-    }
-    int w, h;
-    SDL_QueryTexture(tex, NULL, NULL, &w, &h);
-    argb tfg = canvas->fg;
-    for (int i = 0; i < w; i++) {
-        for (int j = 0; j < h; j++) {
-            argb pixel;
-            SDL_RenderReadPixels(rend, &(SDL_Rect){i, j, 1, 1},
-                                 SDL_PIXELFORMAT_ARGB8888, &pixel,
-                                 sizeof(pixel));
-            if (pixel == 0)
-                continue;
-            canvas->fg = (canvas->fg & 0x00FFFFFF) | (pixel & 0xFF000000);
-            canvas_set_pixel(canvas, x + i, y + j);
+    if (!same_font || t->line.text == NULL || strcmp(t->line.text, text) != 0) {
+        if (!same_font) {
+            free(t->font);
+            t->font = str_copy(font_path);
+            t->size = size;
+            t->bad = false;
         }
+        glyph_face_t *face = font_cache_get(font_path, size);
+        if (face == NULL) {
+            warn("Failed to load font: %s", font_path);
+            t->bad = true;
+            canvas_text_hide(canvas);
+            return;
+        }
+        glyph_line_set(face, &t->line, text);
+        t->shown = false;
     }
-    canvas->fg = tfg;
+    if (t->shown && t->shown_x == t->x && t->shown_y == t->y &&
+            t->shown_fg == canvas->fg)
+        return;
+    layer_clear_extent(&canvas->tfb);
+    const glyph_run_t *run = &t->line.run;
+    canvas->use_tfb = true;
+    if (run->mask != NULL)
+        canvas_draw_mask(canvas, t->x + run->x, t->y + run->y, run->mask,
+                         run->stride, run->w, run->h);
+    canvas->use_tfb = false;
+    t->shown = true;
+    t->shown_x = t->x;
+    t->shown_y = t->y;
+    t->shown_fg = canvas->fg;
+}
 
-    SDL_UnlockSurface(surf);
-    SDL_DestroyTexture(tex);
-    SDL_FreeSurface(surf);
-    SDL_DestroyRenderer(rend);
-    TTF_CloseFont(font);
+/* whether x, y is on the text preview */
+bool canvas_text_hit(const canvas_t *canvas, int x, int y) {
+    const glyph_line_t *line = &canvas->text.line;
+    x -= canvas->text.x;
+    y -= canvas->text.y;
+    return canvas->text.shown && x >= MIN(line->run.x, 0) &&
+           x < MAX(line->run.x + line->run.w, line->width) &&
+           y >= line->run.y && y < line->run.y + line->run.h;
 }
 
 void app_clean(app_t *app) {
-    SDL_DestroyTexture(app->tex);
+    if (app->tex)
+        SDL_DestroyTexture(app->tex);
+    arrfree(app->update_rects);
+    arrfree(app->gui_rects);
     SDL_DestroyRenderer(app->rend);
     SDL_DestroyWindow(app->win);
-    free(app->canvas.fb);
-    free(app->canvas.tfb);
-    for (size_t i = 0; i < dynarray_len(app->font_arr); i++)
-        free(app->font_arr[i].name);
-    arrfree(app->font_arr);
+    if (app->canvas.undo_log)
+        cmdlog_free(&app->canvas.cmdlog);
+    else
+        history_free(&app->canvas.history);
+    cmdlog_op_free(&app->canvas.op);
+    free(app->canvas.text.font);
+    glyph_line_free(&app->canvas.text.line);
+    layer_free(&app->canvas.fb);
+    layer_free(&app->canvas.tfb);
+    arrfree(app->canvas.stroke);
+    mip_free(&app->mip);
     arrfree(app->font_name_arr);
 }
 
 void canvas_save(canvas_t *canvas, const char *file_name, int quality) {
     char *in_rgba = malloc(3 * canvas->w * canvas->h);
-    for (int i = 0; i < canvas->w * canvas->h; i++) {
-        in_rgba[i * 3] = (canvas->fb[i] >> 16) & 0xFF;
-        in_rgba[i * 3 + 1] = (canvas->fb[i] >> 8) & 0xFF;
-        in_rgba[i * 3 + 2] = (canvas->fb[i]) & 0xFF;
+    argb *row = malloc(canvas->w * sizeof(argb));
+    for (int y = 0; y < canvas->h; y++) {
+        char *out = in_rgba + 3 * y * canvas->w;
+        layer_read_row(&canvas->fb, 0, y, canvas->w, row);
+        for (int i = 0; i < canvas->w; i++) {
+            out[i * 3] = (row[i] >> 16) & 0xFF;
+            out[i * 3 + 1] = (row[i] >> 8) & 0xFF;
+            out[i * 3 + 2] = (row[i]) & 0xFF;
+        }
     }
     stbi_write_jpg(file_name, canvas->w, canvas->h, 3, in_rgba, quality);
+    free(row);
     free(in_rgba);
 }
 
 void canvas_flood_fill(canvas_t *canvas, int x, int y) {
     if (y >= canvas->h || y < 0 || x >= canvas->w || x < 0)
         return;
-    static const int dx[] = {-1, 1, 0, 0};
-    static const int dy[] = {0, 0, 1, -1};
-    const argb oldcolor = canvas_get_pixel(canvas, x, y);
-    if (oldcolor == canvas->fg) {
-        return;
-    }
-    vec2i_t *stack = NULL;
-    arrpush(stack, ((vec2i_t){x, y}));
-    canvas_set_pixel(canvas, x, y);
-    while (arrlen(stack) > 0) {
-        vec2i_t v = arrpop(stack);
-        for (int i = 0; i < 4; i++) {
-            vec2i_t nv = {v.x + dx[i], v.y + dy[i]};
-            if (nv.x >= canvas->w || nv.x < 0 || nv.y >= canvas->h ||
-                nv.y < 0)
-                continue;
-            if (canvas_get_pixel(canvas, nv.x, nv.y) != oldcolor)
-                continue;
-            canvas_set_pixel(canvas, v.x, v.y);
-            arrpush(stack, nv);
-        }
-    }
-    arrfree(stack);
+    layer_t *layer = canvas_layer(canvas);
+    const bool blend = canvas_is_blending(canvas);
+    if (canvas->fill_global)
+        fill_global(layer, layer_get(layer, x, y), canvas->fg,
+                    canvas->fill_tolerance, blend);
+    else
+        fill_flood(layer, x, y, canvas->fg, canvas->fill_tolerance, blend);
 }
 
-void canvas_draw_line(canvas_t *canvas, int x1, int y1, int x2, int y2) {
+/* the brush is a square covering x-bs .. x+bs-1, y-bs .. y+bs-1 around each
+ * point of the line. instead of stamping that square at every point, the
+ * area it sweeps is pushed to spans (dynarray) as one span per row */
+static void line_spans(canvas_t *canvas, int x1, int y1, int x2, int y2,
+                       span_t **spans) {
+    const int bs = canvas->brushsize;
+    const int ytop = MIN(y1, y2);
+    const int nrows = abs(y2 - y1) + 1;
+    /* leftmost and rightmost point brehensam puts on every row */
+    int *rowmin = malloc(2 * nrows * sizeof(int));
+    int *rowmax = rowmin + nrows;
+    for (int i = 0; i < nrows; i++) {
+        rowmin[i] = INT_MAX;
+        rowmax[i] = INT_MIN;
+    }
+
     // brehensam line drawing algorithm
     int dx = abs(x2 - x1);
     int sx = x1 < x2 ? 1 : -1;
@@ -392,14 +682,8 @@ void canvas_draw_line(canvas_t *canvas, int x1, int y1, int x2, int y2) {
     int err = dx + dy;
     int e2;
     while (true) {
-        for (int i = -canvas->brushsize; i < canvas->brushsize; i++) {
-            for (int j = -canvas->brushsize; j < canvas->brushsize; j++) {
-                if (x1 + i < 0 || x1 + i >= canvas->w || y1 + j < 0 ||
-                    y1 + j >= canvas->h)
-                    continue;
-                canvas_set_pixel(canvas, x1 + i, y1 + j);
-            }
-        }
+        rowmin[y1 - ytop] = MIN(rowmin[y1 - ytop], x1);
+        rowmax[y1 - ytop] = MAX(rowmax[y1 - ytop], x1);
         if (x1 == x2 && y1 == y2)
             break;
         e2 = 2 * err;
@@ -412,14 +696,213 @@ void canvas_draw_line(canvas_t *canvas, int x1, int y1, int x2, int y2) {
             y1 += sy;
         }
     }
+
+    /* canvas row y is covered by points on rows y-bs+1 .. y+bs. x only
+     * moves one way along a line, so the extremes of that window are on
+     * its first and last row */
+    int ystart = MAX(ytop - bs, 0);
+    int yend = MIN(ytop + nrows - 1 + bs - 1, canvas->h - 1);
+    for (int y = ystart; y <= yend; y++) {
+        int lo = MAX(y - bs + 1 - ytop, 0);
+        int hi = MIN(y + bs - ytop, nrows - 1);
+        if (lo > hi)
+            continue;
+        span_t span = {y, MIN(rowmin[lo], rowmin[hi]) - bs,
+                       MAX(rowmax[lo], rowmax[hi]) + bs - 1};
+        arrpush(*spans, span);
+    }
+    free(rowmin);
+}
+
+static int span_cmp(const void *a, const void *b) {
+    const span_t *sa = a, *sb = b;
+    if (sa->y != sb->y)
+        return sa->y < sb->y ? -1 : 1;
+    return (sa->x1 > sb->x1) - (sa->x1 < sb->x1);
+}
+
+/* brush along the polyline through the n points, the segments' spans are
+ * merged row by row first so pixels at the joints, where consecutive
+ * segments overlap, are painted once like everywhere else */
+void canvas_draw_polyline(canvas_t *canvas, const vec2i_t *pts, int n) {
+    span_t *spans = NULL;
+    if (n == 1)
+        line_spans(canvas, pts[0].x, pts[0].y, pts[0].x, pts[0].y, &spans);
+    for (int i = 1; i < n; i++)
+        line_spans(canvas, pts[i - 1].x, pts[i - 1].y, pts[i].x, pts[i].y,
+                   &spans);
+    const int len = arrlen(spans);
+    /* a single segment gives its spans already sorted, one per row */
+    if (n > 2 && len > 1)
+        qsort(spans, len, sizeof(span_t), span_cmp);
+    for (int i = 0; i < len;) {
+        span_t cur = spans[i++];
+        for (; i < len && spans[i].y == cur.y && spans[i].x1 <= cur.x2 + 1; i++)
+            cur.x2 = MAX(cur.x2, spans[i].x2);
+        canvas_draw_span(canvas, cur.x1, cur.x2, cur.y);
+    }
+    arrfree(spans);
+}
+
+void canvas_draw_line(canvas_t *canvas, int x1, int y1, int x2, int y2) {
+    const vec2i_t pts[2] = {{x1, y1}, {x2, y2}};
+    canvas_draw_polyline(canvas, pts, 2);
+}
+
+/* start and finish one undo step */
+void canvas_op_begin(canvas_t *canvas) {
+    if (!canvas->undo_log) {
+        history_begin(&canvas->history);
+        return;
+    }
+    if (canvas->cmdlog.open)
+        return;
+    cmdlog_begin(&canvas->cmdlog);
+    cmdlog_op_free(&canvas->op);
+    canvas->op.tool = canvas->tool;
+    canvas->op.fg = canvas->fg;
+    canvas->op.brushsize = canvas->brushsize;
+    canvas->op.tolerance = canvas->fill_tolerance;
+    canvas->op.global = canvas->fill_global;
+}
+
+void canvas_op_end(canvas_t *canvas) {
+    if (canvas->undo_log)
+        cmdlog_end(&canvas->cmdlog, &canvas->op);
+    else
+        history_end(&canvas->history);
+}
+
+/* add a point to the operation recorded for --undo-log */
+void canvas_record_point(canvas_t *canvas, int x, int y) {
+    if (!canvas->undo_log)
+        return;
+    arrpush(canvas->op.xy, x);
+    arrpush(canvas->op.xy, y);
+}
+
+bool canvas_undo(canvas_t *canvas) {
+    return canvas->undo_log ? cmdlog_undo(&canvas->cmdlog)
+                            : history_undo(&canvas->history);
+}
+
+bool canvas_redo(canvas_t *canvas) {
+    return canvas->undo_log ? cmdlog_redo(&canvas->cmdlog)
+                            : history_redo(&canvas->history);
+}
+
+/* draw the brush points gathered since the last call as one polyline
+ * starting at lx, ly. called once per frame, so the work follows the
+ * length of the stroke and not how many motion events arrived */
+void canvas_flush_stroke(canvas_t *canvas) {
+    const int n = arrlen(canvas->stroke);
+    if (n == 0)
+        return;
+    vec2i_t *pts = malloc((n + 1) * sizeof(vec2i_t));
+    pts[0] = (vec2i_t){canvas->lx, canvas->ly};
+    memcpy(pts + 1, canvas->stroke, n * sizeof(vec2i_t));
+    canvas_draw_polyline(canvas, pts, n + 1);
+    canvas->lx = pts[n].x;
+    canvas->ly = pts[n].y;
+    if (canvas->undo_log) {
+        for (int i = 1; i <= n; i++)
+            canvas_record_point(canvas, pts[i].x, pts[i].y);
+        arrpush(canvas->op.chunks, arrlen(canvas->op.xy) / 2 - 1);
+    }
+    free(pts);
+    arrsetlen(canvas->stroke, 0);
+}
+
+void canvas_record_text(canvas_t *canvas, int x, int y, const char *text,
+                        const char *font_path, int font_size) {
+    if (!canvas->undo_log)
+        return;
+    canvas->op.tool = TEXT;
+    canvas_record_point(canvas, x, y);
+    canvas->op.text = str_copy(text);
+    canvas->op.font = str_copy(font_path);
+    canvas->op.font_size = font_size;
+}
+
+/* cmdlog replay, draws a recorded operation on fb again the way it was
+ * drawn the first time, the brush in the same pieces it was flushed in */
+void canvas_replay(void *data, const cmdlog_op_t *op) {
+    canvas_t *canvas = data;
+    const argb fg = canvas->fg;
+    const int brushsize = canvas->brushsize;
+    const int tolerance = canvas->fill_tolerance;
+    const bool global = canvas->fill_global;
+    const int *xy = op->xy;
+    /* points each tool reads, a log op with fewer is not drawn */
+    const size_t need =
+        op->tool == LINE || op->tool == RECT || op->tool == RECTFILL ? 4 : 2;
+    if (arrlen(op->xy) < need) {
+        warn("Skipping a logged operation with %zu points",
+             (size_t)arrlen(op->xy) / 2);
+        return;
+    }
+    canvas->fg = op->fg;
+    canvas->brushsize = op->brushsize;
+    canvas->fill_tolerance = op->tolerance;
+    canvas->fill_global = op->global;
+    canvas->use_tfb = false;
+    switch (op->tool) {
+        case BRUSH: {
+            vec2i_t *pts = malloc(arrlen(op->xy) / 2 * sizeof(vec2i_t));
+            for (size_t i = 0; i < arrlen(op->xy) / 2; i++)
+                pts[i] = (vec2i_t){xy[2 * i], xy[2 * i + 1]};
+            int start = 0;
+            for (size_t i = 0; i < arrlen(op->chunks); i++) {
+                canvas_draw_polyline(canvas, pts + start,
+                                     op->chunks[i] - start + 1);
+                start = op->chunks[i];
+            }
+            free(pts);
+            break;
+        }
+        case BUCKET:
+            canvas_flood_fill(canvas, xy[0], xy[1]);
+            break;
+        case LINE:
+            canvas_draw_line(canvas, xy[0], xy[1], xy[2], xy[3]);
+            break;
+        case TEXT:
+            canvas_draw_text(canvas, xy[0], xy[1], op->text, op->font,
+                             op->font_size);
+            break;
+        case RECT:
+            canvas_draw_rect(canvas, xy[0], xy[1], xy[2], xy[3]);
+            break;
+        case RECTFILL:
+            canvas_fill_rect(canvas, xy[0], xy[1], xy[2], xy[3]);
+            break;
+    }
+    canvas->fg = fg;
+    canvas->brushsize = brushsize;
+    canvas->fill_tolerance = tolerance;
+    canvas->fill_global = global;
 }
 
 void canvas_event(canvas_t *canvas, SDL_Event e, gui_t *gui) {
+    /* mouse positions come in window coordinates */
+    switch (e.type) {
+        case SDL_MOUSEBUTTONDOWN:
+        case SDL_MOUSEBUTTONUP:
+            e.button.x = canvas_view_x(canvas, e.button.x);
+            e.button.y = canvas_view_y(canvas, e.button.y);
+            break;
+        case SDL_MOUSEMOTION:
+            e.motion.x = canvas_view_x(canvas, e.motion.x);
+            e.motion.y = canvas_view_y(canvas, e.motion.y);
+            break;
+    }
     switch (e.type) {
         case SDL_MOUSEBUTTONDOWN:
             if (e.button.x < 0 || e.button.x >= canvas->w || e.button.y < 0 ||
                     e.button.y >= canvas->h)
                 break;
+            /* one undo step from press to release */
+            canvas_op_begin(canvas);
             switch (canvas->tool) {
                 case BRUSH: /* FALLTHROUGH */
                 case LINE:
@@ -428,44 +911,75 @@ void canvas_event(canvas_t *canvas, SDL_Event e, gui_t *gui) {
                     canvas->isdrag = true;
                     canvas->lx = e.button.x;
                     canvas->ly = e.button.y;
+                    canvas_record_point(canvas, canvas->lx, canvas->ly);
+                    break;
+                case TEXT:
+                    if (!canvas_text_hit(canvas, e.button.x, e.button.y))
+                        break;
+                    canvas->text.dragging = true;
+                    canvas->text.grab_x = e.button.x - canvas->text.x;
+                    canvas->text.grab_y = e.button.y - canvas->text.y;
                     break;
             }
             break;
         case SDL_MOUSEBUTTONUP:
-            memset(canvas->tfb, 0, canvas->w * canvas->h * sizeof(argb));
+            /* the drag tools only draw what a press on the canvas began */
+            if (!canvas->isdrag && (canvas->tool == BRUSH ||
+                    canvas->tool == LINE || canvas->tool == RECT ||
+                    canvas->tool == RECTFILL))
+                break;
+            canvas_op_begin(canvas);
+            canvas_flush_stroke(canvas);
+            layer_clear_extent(&canvas->tfb);
+            canvas->text.shown = false;
             canvas->isdrag = false;
             switch (canvas->tool) {
                 case BUCKET:
                     canvas_flood_fill(canvas, e.button.x, e.button.y);
+                    canvas_record_point(canvas, e.button.x, e.button.y);
                     break;
                 case LINE:
                     canvas_draw_line(canvas, canvas->lx, canvas->ly, e.motion.x,
                             e.motion.y);
+                    canvas_record_point(canvas, e.motion.x, e.motion.y);
                     break;
                 case TEXT:
+                    /* a click off the text puts it there */
+                    if (!canvas->text.dragging) {
+                        canvas->text.x = e.button.x;
+                        canvas->text.y = e.button.y;
+                    }
+                    canvas->text.dragging = false;
                     gui->text.open_dialog = true;
-                    gui->text.x = e.button.x;
-                    gui->text.y = e.button.y;
                     break;
                 case RECT:
-                    canvas_draw_line(canvas, canvas->lx, canvas->ly, e.motion.x, canvas->ly);
-                    canvas_draw_line(canvas, canvas->lx, canvas->ly, canvas->lx, e.motion.y);
-                    canvas_draw_line(canvas, e.motion.x, canvas->ly, e.motion.x, e.motion.y);
-                    canvas_draw_line(canvas, canvas->lx, e.motion.y, e.motion.x, e.motion.y);
+                    canvas_draw_rect(canvas, canvas->lx, canvas->ly, e.motion.x,
+                            e.motion.y);
+                    canvas_record_point(canvas, e.motion.x, e.motion.y);
                     break;
-                case RECTFILL: {
-                    int sx = MIN(canvas->lx, e.motion.x);
-                    int ex = MAX(canvas->lx, e.motion.x);
-                    int sy = MIN(canvas->ly, e.motion.y);
-                    int ey = MAX(canvas->ly, e.motion.y);
-                    for (int i = sx; i <= ex; i++)
-                        for (int j = sy; j <= ey; j++)
-                            canvas_set_pixel(canvas, i, j);
+                case RECTFILL:
+                    canvas_fill_rect(canvas, canvas->lx, canvas->ly, e.motion.x,
+                            e.motion.y);
+                    canvas_record_point(canvas, e.motion.x, e.motion.y);
                     break;
-                               }
             }
+            canvas_op_end(canvas);
+            break;
+        case SDL_KEYDOWN:
+            if (!(e.key.keysym.mod & KMOD_CTRL))
+                break;
+            if (e.key.keysym.sym == SDLK_y ||
+                    (e.key.keysym.sym == SDLK_z && e.key.keysym.mod & KMOD_SHIFT))
+                canvas_redo(canvas);
+            else if (e.key.keysym.sym == SDLK_z)
+                canvas_undo(canvas);
             break;
         case SDL_MOUSEMOTION:
+            /* shown there by app_text_preview */
+            if (canvas->text.dragging) {
+                canvas->text.x = e.motion.x - canvas->text.grab_x;
+                canvas->text.y = e.motion.y - canvas->text.grab_y;
+            }
             if (!canvas->isdrag) break;
             switch (canvas->tool) {
                 case BRUSH: {
@@ -473,14 +987,12 @@ void canvas_event(canvas_t *canvas, SDL_Event e, gui_t *gui) {
                     int y = e.motion.y;
                     if (x >= canvas->w || y >= canvas->h)
                         break;
-                    canvas_draw_line(canvas, canvas->lx, canvas->ly, x, y);
-                    canvas->lx = x;
-                    canvas->ly = y;
+                    arrpush(canvas->stroke, ((vec2i_t){x, y}));
                     break;
                             }
                 case LINE:
                     canvas->use_tfb = true;
-                    memset(canvas->tfb, 0, canvas->w * canvas->h * sizeof(argb));
+                    layer_clear_extent(&canvas->tfb);
                     canvas_draw_line(canvas, canvas->lx, canvas->ly, e.motion.x,
                             e.motion.y);
                     canvas->use_tfb = false;
@@ -488,11 +1000,9 @@ void canvas_event(canvas_t *canvas, SDL_Event e, gui_t *gui) {
                 case RECT: /* FALLTHROUGH */
                 case RECTFILL:
                     canvas->use_tfb = true;
-                    memset(canvas->tfb, 0, canvas->w * canvas->h * sizeof(argb));
-                    canvas_draw_line(canvas, canvas->lx, canvas->ly, e.motion.x, canvas->ly);
-                    canvas_draw_line(canvas, canvas->lx, canvas->ly, canvas->lx, e.motion.y);
-                    canvas_draw_line(canvas, e.motion.x, canvas->ly, e.motion.x, e.motion.y);
-                    canvas_draw_line(canvas, canvas->lx, e.motion.y, e.motion.x, e.motion.y);
+                    layer_clear_extent(&canvas->tfb);
+                    canvas_draw_rect(canvas, canvas->lx, canvas->ly, e.motion.x,
+                            e.motion.y);
                     canvas->use_tfb = false;
                     break;
             }
@@ -500,11 +1010,53 @@ void canvas_event(canvas_t *canvas, SDL_Event e, gui_t *gui) {
     }
 }
 
-void app_event(app_t *app) {
+/* wheel zooms, middle button drags the view around. true when e was
+ * one of those and should go no further */
+bool app_view_event(app_t *app, SDL_Event *e) {
+    const canvas_t *canvas = &app->canvas;
+    int mx, my;
+    switch (e->type) {
+        case SDL_MOUSEWHEEL:
+            SDL_GetMouseState(&mx, &my);
+            if (my >= app->h || nk_window_is_any_hovered(app->gui.ctx))
+                return false;
+            app_view_zoom(app, canvas->view.zoom * pow(ZOOM_STEP, e->wheel.y),
+                          mx, my);
+            return true;
+        case SDL_MOUSEBUTTONDOWN:
+            if (e->button.button != SDL_BUTTON_MIDDLE || e->button.y >= app->h)
+                return false;
+            app->panning = true;
+            return true;
+        case SDL_MOUSEBUTTONUP:
+            if (e->button.button != SDL_BUTTON_MIDDLE)
+                return false;
+            app->panning = false;
+            return true;
+        case SDL_MOUSEMOTION:
+            if (!app->panning)
+                return false;
+            app_view_set(app, canvas->view.x - e->motion.xrel / canvas->view.zoom,
+                         canvas->view.y - e->motion.yrel / canvas->view.zoom,
+                         canvas->view.zoom);
+            return true;
+    }
+    return false;
+}
+
+/* handle every pending event, waiting up to timeout ms (-1 for ever)
+ * for the first one. nuklear input stays open between frames, see
+ * app_run */
+void app_event(app_t *app, int timeout) {
     SDL_Event e;
-    nk_input_begin(app->gui.ctx);
-    while (SDL_PollEvent(&e)) {
-        if (!nk_item_is_any_active(app->gui.ctx))
+    if (!SDL_WaitEventTimeout(&e, timeout))
+        return;
+    app->redraw = 2;
+    do {
+        /* clicks below the view are the gui's */
+        bool in_view = e.type != SDL_MOUSEBUTTONDOWN || e.button.y < app->h;
+        if (!nk_item_is_any_active(app->gui.ctx) && !app_view_event(app, &e) &&
+                in_view)
             canvas_event(&app->canvas, e, &app->gui);
         switch (e.type) {
         case SDL_QUIT:
@@ -512,8 +1064,7 @@ void app_event(app_t *app) {
             break;
         }
         nk_sdl_handle_event(&e);
-    }
-    nk_input_end(app->gui.ctx);
+    } while (SDL_PollEvent(&e));
 }
 
 /* TODO use more robust way (maybe nk's function)
@@ -533,6 +1084,19 @@ to prevent little-endian, big-endian problem
         ((argb)(colorf.b * 255.0f) << 0) |                                 \
         ((argb)(colorf.a * 255.0f) << 24)
 
+/* whether the font list has been found, its names are taken for the
+ * combobox the first time it has */
+bool app_fonts(app_t *app) {
+    if (app->fonts_ready)
+        return true;
+    if (!font_list_get(&app->font_arr))
+        return false;
+    for (size_t i = 0; i < arrlen(app->font_arr); i++)
+        arrpush(app->font_name_arr, app->font_arr[i].name);
+    app->fonts_ready = true;
+    return true;
+}
+
 void app_draw_gui(app_t *app) {
     gui_t gui = app->gui;
 
@@ -544,12 +1108,21 @@ void app_draw_gui(app_t *app) {
             nk_layout_row_dynamic(gui.ctx, 20, 1);
             if (nk_button_label(gui.ctx, "New"))
                 gui.new.open_dialog = true;
-            nk_layout_row_dynamic(gui.ctx, 20, 1);
+            nk_layout_row_dynamic(gui.ctx, 20, 2);
             if (nk_button_label(gui.ctx, "Save"))
                 gui.save.open_dialog = true;
-            nk_layout_row_dynamic(gui.ctx, 20, 1);
             if (nk_button_label(gui.ctx, "Load"))
                 gui.load.open_dialog = true;
+            nk_layout_row_dynamic(gui.ctx, 20, 2);
+            if (nk_button_label(gui.ctx, "Undo"))
+                canvas_undo(&app->canvas);
+            if (nk_button_label(gui.ctx, "Redo"))
+                canvas_redo(&app->canvas);
+            nk_layout_row_dynamic(gui.ctx, 20, 2);
+            if (nk_button_label(gui.ctx, "Fit"))
+                app_view_fit(app);
+            if (nk_button_label(gui.ctx, "1:1"))
+                app_view_zoom(app, 1, app->w / 2, app->h / 2);
             nk_group_end(gui.ctx);
         }
 
@@ -558,6 +1131,14 @@ void app_draw_gui(app_t *app) {
             nk_label(gui.ctx, "Tool size", NK_TEXT_LEFT);
             nk_layout_row_dynamic(gui.ctx, 20, 1);
             nk_slider_int(gui.ctx, 1, &app->canvas.brushsize, MAX_BRUSHSIZE, 1);
+            if (app->canvas.tool == BUCKET) {
+                nk_layout_row_dynamic(gui.ctx, 20, 1);
+                nk_property_int(gui.ctx, "Tolerance", 0,
+                                &app->canvas.fill_tolerance, 255, 1, 1);
+                nk_layout_row_dynamic(gui.ctx, 20, 1);
+                app->canvas.fill_global = nk_check_label(
+                    gui.ctx, "Global", app->canvas.fill_global);
+            }
             nk_group_end(gui.ctx);
         }
 
@@ -634,7 +1215,7 @@ void app_draw_gui(app_t *app) {
                 gui.new.w = strtol(gui.new.wb, NULL, 10);
                 gui.new.h = strtol(gui.new.hb, NULL, 10);
                 app_clean(app);
-                app_init(app, gui.new.w, gui.new.h);
+                app_init(app, gui.new.w, gui.new.h, app->opts);
                 return;
             }
         } else {
@@ -676,9 +1257,10 @@ void app_draw_gui(app_t *app) {
                             (data[i * 4 + 1] << 8) | (data[i * 4 + 2] << 0);
                     }
                     app_clean(app);
-                    app_init(app, gui.load.w, gui.load.h);
-                    memcpy(app->canvas.fb, in_rgba,
-                           gui.load.w * gui.load.h * 4);
+                    app_init(app, gui.load.w, gui.load.h, app->opts);
+                    for (int y = 0; y < gui.load.h; y++)
+                        layer_write_row(&app->canvas.fb, 0, y, gui.load.w,
+                                        in_rgba + y * gui.load.w);
                     free(in_rgba);
                     free(data);
                     return;
@@ -694,9 +1276,12 @@ void app_draw_gui(app_t *app) {
         if (nk_begin(gui.ctx, "Draw Text", nk_rect(50, 50, 200, 200),
                      NK_WINDOW_MOVABLE | NK_WINDOW_CLOSABLE)) {
             nk_layout_row_dynamic(gui.ctx, 30, 1);
-            nk_combobox(gui.ctx, (const char **)app->font_name_arr,
-                        arrlen(app->font_name_arr), &gui.text.selidx, 30,
-                        nk_vec2(350, 400));
+            if (app_fonts(app))
+                nk_combobox(gui.ctx, (const char **)app->font_name_arr,
+                            arrlen(app->font_name_arr), &gui.text.selidx, 30,
+                            nk_vec2(350, 400));
+            else
+                nk_label(gui.ctx, "Loading fonts...", NK_TEXT_LEFT);
 
             nk_layout_row_dynamic(gui.ctx, 30, 1);
             nk_edit_string_zero_terminated(gui.ctx, NK_EDIT_BOX, gui.text.buf,
@@ -705,10 +1290,19 @@ void app_draw_gui(app_t *app) {
             nk_label(gui.ctx, "Size", NK_TEXT_LEFT);
             nk_slider_int(gui.ctx, 1, &gui.text.size, 256, 1);
             nk_layout_row_dynamic(gui.ctx, 30, 2);
-            if (nk_button_label(gui.ctx, "Draw")) {
-                canvas_draw_text(
-                    &app->canvas, gui.text.x, gui.text.y, gui.text.buf,
-                    app->font_arr[gui.text.selidx].path, gui.text.size);
+            if (arrlen(app->font_arr) > 0 && nk_button_label(gui.ctx, "Draw")) {
+                canvas_t *canvas = &app->canvas;
+                canvas_text_hide(canvas);
+                canvas_op_begin(canvas);
+                canvas_draw_text(canvas, canvas->text.x, canvas->text.y,
+                                 gui.text.buf,
+                                 app->font_arr[gui.text.selidx].path,
+                                 gui.text.size);
+                canvas_record_text(canvas, canvas->text.x, canvas->text.y,
+                                   gui.text.buf,
+                                   app->font_arr[gui.text.selidx].path,
+                                   gui.text.size);
+                canvas_op_end(canvas);
                 gui.text.open_dialog = false;
                 gui.text.buf[0] = 0;
             }
@@ -722,40 +1316,364 @@ void app_draw_gui(app_t *app) {
     app->gui = gui;
 }
 
+SDL_Rect tile_rect(layer_t *layer, int tx, int ty) {
+    return (SDL_Rect){
+        .x = tx * TILE_SIZE,
+        .y = ty * TILE_SIZE,
+        .w = MIN(TILE_SIZE, layer->w - tx * TILE_SIZE),
+        .h = MIN(TILE_SIZE, layer->h - ty * TILE_SIZE),
+    };
+}
+
+/* zoomed in (or 1:1): every window pixel shows the canvas pixel under its
+ * centre. window columns map to a contiguous run of canvas columns, so
+ * each canvas row needed is composited once into a buffer and sampled */
+static void app_render_nearest(app_t *app, SDL_Rect r, uint8_t *out,
+                               int pitch) {
+    const canvas_t *canvas = &app->canvas;
+    const argb bg = 0xFF000000;
+    int *xs = malloc(r.w * sizeof(int));
+    int first = r.w, last = -1;
+    for (int i = 0; i < r.w; i++) {
+        xs[i] = canvas_view_x(canvas, r.x + i);
+        if (xs[i] >= 0 && xs[i] < canvas->w) {
+            first = MIN(first, i);
+            last = i;
+        }
+    }
+    argb *row = malloc(MAX(last - first + 1, 1) * sizeof(argb));
+    int prev = -1;
+    for (int j = 0; j < r.h; j++) {
+        argb *dst = (argb *)(out + j * pitch);
+        int cy = canvas_view_y(canvas, r.y + j);
+        if (cy < 0 || cy >= canvas->h || first > last) {
+            set_span(dst, bg, r.w);
+            continue;
+        }
+        if (cy != prev) {
+            mip_read_row(&app->mip, 0, xs[first], cy, xs[last] - xs[first] + 1,
+                         row);
+            prev = cy;
+        }
+        set_span(dst, bg, first);
+        for (int i = first; i <= last; i++) {
+            argb c = row[xs[i] - xs[first]];
+            dst[i] = app->tex_swap_rb ? argb_swap_rb(c) : c;
+        }
+        set_span(dst + last + 1, bg, r.w - last - 1);
+    }
+    free(row);
+    free(xs);
+}
+
+/* zoomed out: every window pixel is the average of the pixels it covers
+ * in the mipmap level just above the view's size, where it covers one
+ * to two pixels each way. the boxes tile the level, so each of its
+ * pixels in view is read once */
+static void app_render_box(app_t *app, SDL_Rect r, uint8_t *out, int pitch) {
+    const canvas_t *canvas = &app->canvas;
+    int level = 0;
+    while (level + 1 < app->mip.nlevels && canvas->view.zoom * (2 << level) <= 1)
+        level++;
+    const int lw = mip_width(&app->mip, level);
+    const int lh = mip_height(&app->mip, level);
+    const double vx = canvas->view.x / (1 << level);
+    const double vy = canvas->view.y / (1 << level);
+    const double s = 1 / (canvas->view.zoom * (1 << level));
+    /* window column i covers level columns x0[i] .. x0[i+1]-1 */
+    int *x0 = malloc((r.w + 1) * sizeof(int));
+    for (int i = 0; i <= r.w; i++) {
+        int x = (int)floor(vx + (r.x + i) * s);
+        x0[i] = MIN(MAX(x, 0), lw);
+    }
+    const int n = x0[r.w] - x0[0];
+    argb *row = malloc(MAX(n, 1) * sizeof(argb));
+    uint32_t *sum = malloc(r.w * 4 * sizeof(uint32_t));
+    for (int j = 0; j < r.h; j++) {
+        argb *dst = (argb *)(out + j * pitch);
+        int y0 = (int)floor(vy + (r.y + j) * s);
+        int y1 = (int)floor(vy + (r.y + j + 1) * s);
+        y0 = MIN(MAX(y0, 0), lh);
+        y1 = MIN(MAX(y1, 0), lh);
+        memset(sum, 0, r.w * 4 * sizeof(uint32_t));
+        for (int cy = y0; cy < y1 && n > 0; cy++) {
+            mip_read_row(&app->mip, level, x0[0], cy, n, row);
+            const argb *p = row;
+            for (int i = 0; i < r.w; i++) {
+                for (int cx = x0[i]; cx < x0[i + 1]; cx++, p++) {
+                    sum[4 * i + 0] += *p & 0xFF;
+                    sum[4 * i + 1] += (*p >> 8) & 0xFF;
+                    sum[4 * i + 2] += (*p >> 16) & 0xFF;
+                    sum[4 * i + 3] += *p >> 24;
+                }
+            }
+        }
+        for (int i = 0; i < r.w; i++) {
+            uint32_t cnt = (uint32_t)(x0[i + 1] - x0[i]) * (y1 - y0);
+            if (cnt == 0) {
+                dst[i] = 0xFF000000;
+                continue;
+            }
+            argb c = 0;
+            for (int k = 0; k < 4; k++)
+                c |= ((sum[4 * i + k] + cnt / 2) / cnt) << (8 * k);
+            dst[i] = app->tex_swap_rb ? argb_swap_rb(c) : c;
+        }
+    }
+    free(sum);
+    free(row);
+    free(x0);
+}
+
+/* window rect r of the view into out, whose rows are pitch bytes apart */
+void app_render_view(app_t *app, SDL_Rect r, void *out, int pitch) {
+    if (app->canvas.view.zoom >= 1)
+        app_render_nearest(app, r, out, pitch);
+    else
+        app_render_box(app, r, out, pitch);
+}
+
+/* the composite changed wherever either layer did, so the preview's
+ * dirty tiles are folded into the canvas' list */
+void app_merge_dirty(app_t *app) {
+    layer_t *fb = &app->canvas.fb, *tfb = &app->canvas.tfb;
+    for (size_t i = 0; i < arrlen(tfb->dirty_list); i++)
+        layer_mark_dirty(fb, tfb->dirty_list[i] % tfb->tw,
+                         tfb->dirty_list[i] / tfb->tw);
+    layer_clear_dirty(tfb);
+}
+
+/* the rects of the view to render this frame, into app->update_rects.
+ * all of it once the view moved, otherwise wherever a changed tile
+ * shows, one rect per run of changed tiles in a tile row. a pixel more
+ * on each side, the box filter's boxes straddle */
+void app_collect_view_rects(app_t *app) {
+    const canvas_t *canvas = &app->canvas;
+    layer_t *fb = &app->canvas.fb;
+    const SDL_Rect view = {0, 0, app->w, app->h};
+    const double z = canvas->view.zoom;
+    arrsetlen(app->update_rects, 0);
+    app_merge_dirty(app);
+    for (size_t i = 0; i < arrlen(fb->dirty_list); i++)
+        mip_mark(&app->mip, fb->dirty_list[i] % fb->tw,
+                 fb->dirty_list[i] / fb->tw);
+    if (app->view_moved) {
+        arrpush(app->update_rects, view);
+        app->view_moved = false;
+        layer_clear_dirty(fb);
+        return;
+    }
+    SDL_Rect bounds = {0};
+    for (size_t i = 0; i < arrlen(fb->dirty_list); i++) {
+        const int tile = fb->dirty_list[i];
+        const int tx = tile % fb->tw, ty = tile / fb->tw;
+        /* runs are found from their first tile */
+        if (tx > 0 && fb->dirty[tile - 1])
+            continue;
+        int tx2 = tx;
+        while (tx2 + 1 < fb->tw && fb->dirty[tile + tx2 + 1 - tx])
+            tx2++;
+        SDL_Rect t = tile_rect(fb, tx, ty), t2 = tile_rect(fb, tx2, ty);
+        int x1 = (int)floor((t.x - canvas->view.x) * z) - 1;
+        int y1 = (int)floor((t.y - canvas->view.y) * z) - 1;
+        int x2 = (int)ceil((t2.x + t2.w - canvas->view.x) * z) + 1;
+        int y2 = (int)ceil((t.y + t.h - canvas->view.y) * z) + 1;
+        SDL_Rect r = {x1, y1, x2 - x1, y2 - y1};
+        if (!SDL_IntersectRect(&r, &view, &r))
+            continue;
+        arrpush(app->update_rects, r);
+        SDL_UnionRect(&bounds, &r, &bounds);
+    }
+    /* a big change, one lock or one rect to send is cheaper than many */
+    if (arrlen(app->update_rects) > (size_t)MAX_UPDATE_RECTS) {
+        arrsetlen(app->update_rects, 1);
+        app->update_rects[0] = bounds;
+    }
+    layer_clear_dirty(fb);
+}
+
+/* render the changed parts of the view straight into the locked texture,
+ * no staging copy in between */
+void app_update_texture(app_t *app) {
+    app_collect_view_rects(app);
+    for (size_t i = 0; i < arrlen(app->update_rects); i++) {
+        void *pixels;
+        int pitch;
+        if (SDL_LockTexture(app->tex, &app->update_rects[i], &pixels, &pitch) < 0) {
+            warn("SDL_LockTexture Failed %s", SDL_GetError());
+            continue;
+        }
+        app_render_view(app, app->update_rects[i], pixels, pitch);
+        SDL_UnlockTexture(app->tex);
+    }
+}
+
 void app_draw_canvas(app_t *app) {
     SDL_SetRenderDrawColor(app->rend, 0, 0, 0, 255);
     SDL_RenderClear(app->rend);
-    SDL_UpdateTexture(app->tex, NULL, app->canvas.fb,
-                      app->canvas.w * sizeof(*app->canvas.fb));
+    app_update_texture(app);
     const SDL_Rect dstrect = {
-        .w = app->canvas.w,
-        .h = app->canvas.h,
+        .w = app->w,
+        .h = app->h,
     };
     SDL_RenderCopy(app->rend, app->tex, NULL, &dstrect);
-    SDL_UpdateTexture(app->tex, NULL, app->canvas.tfb,
-                      app->canvas.w * sizeof(*app->canvas.tfb));
-    SDL_RenderCopy(app->rend, app->tex, NULL, &dstrect);
 }
 
-void app_run(app_t *app) {
-    /* TODO better frame capping (time ms used for each frame)
-    and subtract it from 16.6666 */
-    while (app->running) {
-        app_event(app);
+/* surface backend: the view is rendered right into the window surface,
+ * only where it changed or where gui windows covered it last frame. the
+ * rest of the window is the gui's, cleared for it to draw on */
+void app_draw_surface(app_t *app) {
+    SDL_Surface *surface = app->surface;
+    const SDL_Rect view = {0, 0, app->w, app->h};
+    app_collect_view_rects(app);
+    for (size_t i = 0; i < arrlen(app->gui_rects); i++) {
+        SDL_Rect r;
+        if (SDL_IntersectRect(&app->gui_rects[i], &view, &r))
+            arrpush(app->update_rects, r);
+    }
+    if (SDL_MUSTLOCK(surface))
+        SDL_LockSurface(surface);
+    for (size_t i = 0; i < arrlen(app->update_rects); i++) {
+        SDL_Rect r = app->update_rects[i];
+        app_render_view(app, r,
+                        (uint8_t *)surface->pixels + r.y * surface->pitch +
+                            r.x * sizeof(argb),
+                        surface->pitch);
+    }
+    if (SDL_MUSTLOCK(surface))
+        SDL_UnlockSurface(surface);
+
+    const SDL_Rect bg = {0, app->h, surface->w, surface->h - app->h};
+    SDL_FillRect(surface, &bg, SDL_MapRGB(surface->format, 0, 0, 0));
+    arrpush(app->update_rects, bg);
+}
+
+/* surface backend, after the gui is drawn: send every rect that changed
+ * to the window. those are the canvas tiles, the background and the gui
+ * windows, now and last frame since they may have moved or closed */
+void app_present_surface(app_t *app) {
+    SDL_Rect bounds = {0, 0, app->surface->w, app->surface->h};
+    for (size_t i = 0; i < arrlen(app->gui_rects); i++)
+        arrpush(app->update_rects, app->gui_rects[i]);
+    arrsetlen(app->gui_rects, 0);
+    for (struct nk_window *win = app->gui.ctx->begin; win; win = win->next) {
+        if (win->flags & NK_WINDOW_HIDDEN)
+            continue;
+        /* combo boxes and such are popups, drawn outside their window */
+        const struct nk_window *wins[2] = {win, win->popup.win};
+        for (int i = 0; i < 2 && wins[i]; i++) {
+            if (wins[i]->flags & NK_WINDOW_HIDDEN)
+                continue;
+            SDL_Rect r = {(int)wins[i]->bounds.x, (int)wins[i]->bounds.y,
+                          (int)wins[i]->bounds.w + 1, (int)wins[i]->bounds.h + 1};
+            if (SDL_IntersectRect(&r, &bounds, &r)) {
+                arrpush(app->gui_rects, r);
+                arrpush(app->update_rects, r);
+            }
+        }
+    }
+    if (SDL_UpdateWindowSurfaceRects(app->win, app->update_rects,
+                                     arrlen(app->update_rects)) < 0)
+        warn("SDL_UpdateWindowSurfaceRects Failed %s", SDL_GetError());
+}
+
+/* one frame through either backend, with opts.bench the time of each
+ * part is summed and logged every BENCH_FRAMES frames */
+void app_draw(app_t *app) {
+    Uint64 t0 = SDL_GetPerformanceCounter();
+    if (app->opts.surface)
+        app_draw_surface(app);
+    else
         app_draw_canvas(app);
-        app_draw_gui(app);
+    Uint64 t1 = SDL_GetPerformanceCounter();
+    app_draw_gui(app);
+    Uint64 t2 = SDL_GetPerformanceCounter();
+    /* app_draw_gui may have re-created the app, backend included */
+    if (app->opts.surface)
+        app_present_surface(app);
+    else
         SDL_RenderPresent(app->rend);
-        SDL_Delay(15);
+    Uint64 t3 = SDL_GetPerformanceCounter();
+
+    if (!app->opts.bench)
+        return;
+    app->bench.canvas += t1 - t0;
+    app->bench.gui += t2 - t1;
+    app->bench.present += t3 - t2;
+    if (++app->bench.frames < BENCH_FRAMES)
+        return;
+    const double ms = 1000.0 / SDL_GetPerformanceFrequency() / app->bench.frames;
+    info("%s, %s blend: canvas %.3f ms, gui %.3f ms, present %.3f ms per frame",
+         app->opts.surface ? "surface" : "renderer", blend_kernel_name(),
+         app->bench.canvas * ms,
+         app->bench.gui * ms, app->bench.present * ms);
+    memset(&app->bench, 0, sizeof(app->bench));
+}
+
+/* the text tool's text on tfb while its dialog is open, before the
+ * canvas is drawn so a drag shows in the same frame */
+void app_text_preview(app_t *app) {
+    const gui_t *gui = &app->gui;
+    if (!gui->text.open_dialog || app->canvas.tool != TEXT ||
+            !app_fonts(app) || arrlen(app->font_arr) == 0) {
+        canvas_text_hide(&app->canvas);
+        return;
     }
+    canvas_text_show(&app->canvas, gui->text.buf,
+                     app->font_arr[gui->text.selidx].path, gui->text.size);
+}
+
+/* sleeps in SDL_WaitEventTimeout until there is something to draw. while
+ * frames are due, input is handled up to the moment the next one starts,
+ * so it shows up in the very next frame. nuklear wants all input of a
+ * frame between one nk_input_begin and nk_input_end, so that pair
+ * brackets everything handled between two frames */
+void app_run(app_t *app) {
+    const Uint64 freq = SDL_GetPerformanceFrequency();
+    const Uint64 frame = freq / TARGET_FPS;
+    Uint64 last = SDL_GetPerformanceCounter() - frame;
+    nk_input_begin(app->gui.ctx);
+    while (app->running) {
+        int timeout = -1;
+        if (app->redraw > 0) {
+            Uint64 spent = SDL_GetPerformanceCounter() - last;
+            /* rounded up, waking early would only spin until it is time */
+            timeout = USE_VSYNC || spent >= frame
+                          ? 0
+                          : (int)(((frame - spent) * 1000 + freq - 1) / freq);
+        }
+        app_event(app, timeout);
+        if (app->redraw == 0 || !app->running)
+            continue;
+        if (!USE_VSYNC && SDL_GetPerformanceCounter() - last < frame)
+            continue;
+        last = SDL_GetPerformanceCounter();
+        app->redraw--;
+        canvas_flush_stroke(&app->canvas);
+        app_text_preview(app);
+        nk_input_end(app->gui.ctx);
+        app_draw(app);
+        /* app_draw_gui may have re-created the app, and the context */
+        nk_input_begin(app->gui.ctx);
+    }
+    nk_input_end(app->gui.ctx);
 }
 
 int main(int argc, char **argv) {
     int w = 800;
     int h = 600;
 
+    app_opts_t opts = {0};
+
     /* TODO - better argument parsing and more options */
-    if (argc >= 2) {
-        if (sscanf(argv[1], "%dx%d", &w, &h) != 2) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--surface") == 0) {
+            opts.surface = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            opts.bench = true;
+        } else if (strcmp(argv[i], "--undo-log") == 0) {
+            opts.undo_log = true;
+        } else if (sscanf(argv[i], "%dx%d", &w, &h) != 2) {
             w = 800;
             h = 600;
         }
@@ -763,15 +1681,17 @@ int main(int argc, char **argv) {
 
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0)
         warn("SDL_Init Failed %s", SDL_GetError());
-    if (TTF_Init() < 0)
-        warn("TTF_Init Failed %s", TTF_GetError());
+    blend_init();
+    font_cache_init(FONT_CACHE_BUDGET);
+    font_list_init();
 
     app_t app;
-    app_init(&app, w, h);
+    app_init(&app, w, h, opts);
     app_run(&app);
     app_clean(&app);
 
-    TTF_Quit();
+    font_list_free();
+    font_cache_free();
     SDL_Quit();
     return EXIT_SUCCESS;
 }
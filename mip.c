@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "blend.h"
+#include "mip.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* per channel average of four pixels, rounded, two channels at a time */
+static inline argb avg4(argb a, argb b, argb c, argb d) {
+    uint32_t rb = (a & 0x00FF00FF) + (b & 0x00FF00FF) + (c & 0x00FF00FF) +
+                  (d & 0x00FF00FF) + 0x00020002;
+    uint32_t ag = ((a >> 8) & 0x00FF00FF) + ((b >> 8) & 0x00FF00FF) +
+                  ((c >> 8) & 0x00FF00FF) + ((d >> 8) & 0x00FF00FF) + 0x00020002;
+    return ((rb >> 2) & 0x00FF00FF) | ((ag << 6) & 0xFF00FF00);
+}
+
+int mip_width(const mip_t *mip, int level) {
+    return (mip->fb->w + (1 << level) - 1) >> level;
+}
+
+int mip_height(const mip_t *mip, int level) {
+    return (mip->fb->h + (1 << level) - 1) >> level;
+}
+
+static int tiles_across(int w) {
+    return (w + TILE_MASK) >> TILE_SHIFT;
+}
+
+void mip_init(mip_t *mip, const layer_t *fb, const layer_t *tfb) {
+    mip->fb = fb;
+    mip->tfb = tfb;
+    /* down to the first level that fits in one tile */
+    mip->nlevels = 1;
+    while (mip_width(mip, mip->nlevels - 1) > TILE_SIZE ||
+           mip_height(mip, mip->nlevels - 1) > TILE_SIZE)
+        mip->nlevels++;
+    mip->levels = calloc(mip->nlevels, sizeof(*mip->levels));
+    mip->stale = calloc(mip->nlevels, sizeof(*mip->stale));
+    if (mip->levels == NULL || mip->stale == NULL)
+        panic("Failed to allocate memory for mipmaps");
+    const argb clear = blend_pixel(fb->clear, tfb->clear);
+    for (int k = 1; k < mip->nlevels; k++) {
+        layer_t *level = &mip->levels[k];
+        layer_init(level, mip_width(mip, k), mip_height(mip, k), clear);
+        /* the level's own dirty tracking has no reader */
+        layer_clear_dirty(level);
+        /* nothing is made yet */
+        mip->stale[k] = malloc((size_t)level->tw * level->th);
+        if (mip->stale[k] == NULL)
+            panic("Failed to allocate memory for mipmaps");
+        memset(mip->stale[k], 1, (size_t)level->tw * level->th);
+    }
+}
+
+void mip_free(mip_t *mip) {
+    for (int k = 1; k < mip->nlevels; k++) {
+        layer_free(&mip->levels[k]);
+        free(mip->stale[k]);
+    }
+    free(mip->levels);
+    free(mip->stale);
+    mip->levels = NULL;
+    mip->stale = NULL;
+    mip->nlevels = 0;
+}
+
+void mip_mark(mip_t *mip, int tx, int ty) {
+    for (int k = 1; k < mip->nlevels; k++) {
+        tx >>= 1;
+        ty >>= 1;
+        uint8_t *stale = &mip->stale[k][ty * mip->levels[k].tw + tx];
+        /* and so is everything above it */
+        if (*stale)
+            return;
+        *stale = 1;
+    }
+}
+
+/* tile never written, all of it is the clear colour */
+static bool untouched(const mip_t *mip, int level, int tx, int ty) {
+    if (level == 0) {
+        int i = ty * mip->fb->tw + tx;
+        return mip->fb->tiles[i] == NULL && mip->tfb->tiles[i] == NULL;
+    }
+    return mip->levels[level].tiles[ty * mip->levels[level].tw + tx] == NULL;
+}
+
+/* level 0 row, the preview composited over the canvas */
+static void compose_row(const mip_t *mip, int x, int y, int n, argb *out) {
+    while (n > 0) {
+        /* both layers have the same tiles, so the spans end together */
+        int m;
+        const argb *fb = layer_span(mip->fb, x, y, &m);
+        const argb *tfb = layer_span(mip->tfb, x, y, &m);
+        m = MIN(m, n);
+        over_span(out, fb, tfb, m, false);
+        x += m;
+        out += m;
+        n -= m;
+    }
+}
+
+/* row of a level whose tiles are known to be up to date */
+static void fresh_row(const mip_t *mip, int level, int x, int y, int n,
+                      argb *out) {
+    if (level == 0)
+        compose_row(mip, x, y, n, out);
+    else
+        layer_read_row(&mip->levels[level], x, y, n, out);
+}
+
+/* bring tile tx, ty of level k >= 1 up to date, its stale children
+ * first. a tile over children that were all never written stays NULL */
+static void refresh(mip_t *mip, int k, int tx, int ty) {
+    layer_t *level = &mip->levels[k];
+    const int cw = mip_width(mip, k - 1), ch = mip_height(mip, k - 1);
+    bool touched = false;
+    for (int cy = 2 * ty; cy <= 2 * ty + 1 && cy < tiles_across(ch); cy++) {
+        for (int cx = 2 * tx; cx <= 2 * tx + 1 && cx < tiles_across(cw); cx++) {
+            if (k > 1 && mip->stale[k - 1][cy * mip->levels[k - 1].tw + cx])
+                refresh(mip, k - 1, cx, cy);
+            touched |= !untouched(mip, k - 1, cx, cy);
+        }
+    }
+    mip->stale[k][ty * level->tw + tx] = 0;
+    if (!touched && level->tiles[ty * level->tw + tx] == NULL)
+        return;
+
+    argb *tile = layer_tile_w(level, tx, ty);
+    const int x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+    const int cols = MIN(TILE_SIZE, level->w - x0);
+    const int rows = MIN(TILE_SIZE, level->h - y0);
+    /* the last child column (or row) is alone when the child is odd */
+    const int cn = MIN(2 * cols, cw - 2 * x0);
+    argb a[2 * TILE_SIZE], b[2 * TILE_SIZE];
+    for (int y = 0; y < rows; y++) {
+        argb *dst = tile + y * TILE_SIZE;
+        int cy = 2 * (y0 + y);
+        fresh_row(mip, k - 1, 2 * x0, cy, cn, a);
+        if (cy + 1 < ch)
+            fresh_row(mip, k - 1, 2 * x0, cy + 1, cn, b);
+        else
+            memcpy(b, a, cn * sizeof(argb));
+        for (int x = 0; x < cols; x++) {
+            int i = 2 * x, j = i + 1 < cn ? i + 1 : i;
+            dst[x] = avg4(a[i], a[j], b[i], b[j]);
+        }
+    }
+    /* the level's own dirty tracking has no reader */
+    layer_clear_dirty(level);
+}
+
+void mip_read_row(mip_t *mip, int level, int x, int y, int n, argb *out) {
+    if (n <= 0)
+        return;
+    if (level == 0) {
+        compose_row(mip, x, y, n, out);
+        return;
+    }
+    layer_t *l = &mip->levels[level];
+    const int ty = y >> TILE_SHIFT;
+    for (int tx = x >> TILE_SHIFT; tx <= (x + n - 1) >> TILE_SHIFT; tx++)
+        if (mip->stale[level][ty * l->tw + tx])
+            refresh(mip, level, tx, ty);
+    layer_read_row(l, x, y, n, out);
+}
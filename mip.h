@@ -0,0 +1,40 @@
+#pragma once
+
+#ifndef SDRAW_MIP_H
+#define SDRAW_MIP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "layer.h"
+
+/* pyramid of 2x reductions of the preview composited over the canvas,
+ * for drawing it zoomed out. level 0 is the composite itself, made on
+ * the fly from the two layers. level k > 0 is half the size of level
+ * k-1 (rounded up), every pixel the average of the 2x2 below it.
+ * tiles are only made again when asked for after something under them
+ * changed, so a small edit costs one small tile per level */
+typedef struct {
+    const layer_t *fb, *tfb;
+    int nlevels;
+    /* levels[k] for k >= 1, levels[0] unused */
+    layer_t *levels;
+    /* stale[k][i] is set when tile i of level k is out of date. a stale
+     * tile's parent is always stale too */
+    uint8_t **stale;
+} mip_t;
+
+void mip_init(mip_t *mip, const layer_t *fb, const layer_t *tfb);
+void mip_free(mip_t *mip);
+
+/* tile tx, ty of level 0 changed */
+void mip_mark(mip_t *mip, int tx, int ty);
+
+int mip_width(const mip_t *mip, int level);
+int mip_height(const mip_t *mip, int level);
+
+/* n pixels of row y of level, starting at x, into out. brings the tiles
+ * read up to date first */
+void mip_read_row(mip_t *mip, int level, int x, int y, int n, argb *out);
+
+#endif